@@ -0,0 +1,241 @@
+// Copyright (c) 2023 Vaci Koblizek.
+// Licensed under the Apache 2.0 license found in the LICENSE file or at:
+//     https://opensource.org/licenses/Apache-2.0
+
+// Round trip latency and throughput of `Hello.greet` over localhost UDP,
+// swept over the loss rates injected by the embedded media driver's loss
+// interceptor, for small calls and for large ones that take the
+// fragmented path in both directions.
+
+#include "aeron-rpc.h"
+#include "driver.h"
+#include "histogram.h"
+#include "hello.capnp.h"
+
+#include <kj/async-io.h>
+#include <kj/debug.h>
+#include <kj/main.h>
+#include <kj/time.h>
+#include <kj/vector.h>
+
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace aeroncap;
+
+namespace {
+
+// Drops received frames at random, as configured by the environment, see
+// aeron_udp_channel_transport_loss.h. The interceptor reads its args just
+// once per process.
+constexpr auto LOSS_INTERCEPTOR = "loss";
+constexpr auto LOSS_ARGS_ENV = "AERON_UDP_CHANNEL_TRANSPORT_LOSS_ARGS";
+
+DriverOptions lossy(double lossRate) {
+  DriverOptions options{.threading = DriverThreading::DEDICATED};
+  if (lossRate > 0.0) {
+    // data frames only, so that the handshake's setup still gets through
+    auto args = kj::str("rate=", lossRate, "|recv-msg-mask=0x2");
+    setenv(LOSS_ARGS_ENV, args.cStr(), true);
+    options.configure.emplace([](aeron_driver_context_t* context) {
+      if (aeron_driver_context_set_udp_channel_incoming_interceptors(
+	    context, LOSS_INTERCEPTOR)) {
+	auto errcode = aeron_errcode();
+	auto errmsg = aeron_errmsg();
+	KJ_FAIL_REQUIRE("aeron_driver_context_set_udp_channel_incoming_interceptors",
+			errcode, errmsg);
+      }
+    });
+  }
+  else {
+    unsetenv(LOSS_ARGS_ENV);
+  }
+  return options;
+}
+
+// Echoes the name, so that large calls are large in both directions.
+struct EchoServer
+  : Hello::Server {
+
+  kj::Promise<void> greet(GreetContext ctx) override {
+    ctx.getResults().setGreeting(ctx.getParams().getName());
+    return kj::READY_NOW;
+  }
+};
+
+kj::Array<double> parseRates(kj::StringPtr arg) {
+  kj::Vector<double> rates;
+  auto add = [&rates](kj::StringPtr rate) {
+    auto value = rate.parseAs<double>();
+    KJ_REQUIRE(value >= 0.0 && value <= 1.0, value);
+    rates.add(value);
+  };
+  while (true) {
+    KJ_IF_MAYBE(comma, arg.findFirst(',')) {
+      add(kj::str(arg.slice(0, *comma)));
+      arg = arg.slice(*comma + 1);
+    }
+    else {
+      add(arg);
+      return rates.releaseAsArray();
+    }
+  }
+}
+
+kj::Maybe<uint32_t> parsePositive(kj::StringPtr arg) {
+  uint32_t value = 0;
+  KJ_IF_MAYBE(exc, kj::runCatchingExceptions([&]() { value = arg.parseAs<uint32_t>(); })) {
+    return nullptr;
+  }
+  if (value == 0) {
+    return nullptr;
+  }
+  return value;
+}
+
+}
+
+struct Bench {
+
+  explicit Bench(kj::ProcessContext& ctx)
+    : ctx_{ctx} {
+  }
+
+  kj::MainFunc getMain() {
+    return kj::MainBuilder(
+	ctx_, "aeron-rpc-bench",
+	"Measures the latency and throughput of RPCs over localhost UDP, "
+	"with the media driver dropping a proportion of received data frames.")
+      .addOptionWithArg({'l', "loss"}, KJ_BIND_METHOD(*this, setLoss),
+			"<rates>", "comma separated loss rates to sweep (default: 0,0.001,0.01,0.05)")
+      .addOptionWithArg({'n', "count"}, KJ_BIND_METHOD(*this, setCount),
+			"<count>", "round trips per measurement (default: 10000)")
+      .addOptionWithArg({'s', "size"}, KJ_BIND_METHOD(*this, setSize),
+			"<bytes>", "size of the large calls (default: 65536)")
+      .addOptionWithArg({'w', "window"}, KJ_BIND_METHOD(*this, setWindow),
+			"<calls>", "calls in flight for throughput (default: 64)")
+      .callAfterParsing(KJ_BIND_METHOD(*this, run))
+      .build();
+  }
+
+private:
+  kj::MainBuilder::Validity setLoss(kj::StringPtr arg) {
+    KJ_IF_MAYBE(exc, kj::runCatchingExceptions([&]() { rates_ = parseRates(arg); })) {
+      return "invalid loss rates";
+    }
+    return true;
+  }
+
+  kj::MainBuilder::Validity setCount(kj::StringPtr arg) {
+    KJ_IF_MAYBE(count, parsePositive(arg)) {
+      count_ = *count;
+      return true;
+    }
+    return "invalid count";
+  }
+
+  kj::MainBuilder::Validity setSize(kj::StringPtr arg) {
+    KJ_IF_MAYBE(size, parsePositive(arg)) {
+      size_ = *size;
+      return true;
+    }
+    return "invalid size";
+  }
+
+  kj::MainBuilder::Validity setWindow(kj::StringPtr arg) {
+    KJ_IF_MAYBE(window, parsePositive(arg)) {
+      window_ = *window;
+      return true;
+    }
+    return "invalid window";
+  }
+
+  kj::MainBuilder::Validity run() {
+    for (auto rate: rates_) {
+      // a process of its own for each point of the sweep, as the loss
+      // interceptor only reads its rate once per process
+      pid_t pid;
+      KJ_SYSCALL(pid = fork());
+      if (pid == 0) {
+	KJ_IF_MAYBE(exc, kj::runCatchingExceptions([&]() { measure(rate); })) {
+	  ctx_.error(kj::str("loss=", rate, ": ", *exc));
+	  _exit(1);
+	}
+	_exit(0);
+      }
+
+      int status;
+      KJ_SYSCALL(waitpid(pid, &status, 0));
+      if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+	return "measurement failed";
+      }
+    }
+    return true;
+  }
+
+  void measure(double rate) {
+    auto io = kj::setupAsyncIo();
+    auto& timer = io.provider->getTimer();
+
+    EmbeddedDriver driver{lossy(rate)};
+    auto aeron = driver.connect();
+
+    Listener listener{timer, aeron, "aeron:udp?endpoint=localhost:40123", 1};
+    Connector connector{timer, aeron, "aeron:udp?endpoint=localhost:40124", 2};
+    TwoPartyServer server{kj::heap<EchoServer>()};
+    auto listening = server.listen(listener);
+
+    auto stream = connector.connect("aeron:udp?endpoint=localhost:40123", 1).wait(io.waitScope);
+    TwoPartyClient client{*stream};
+    auto cap = client.bootstrap().castAs<Hello>();
+
+    for (auto size: {size_t{16}, size_t{size_}}) {
+      auto name = kj::str(kj::repeat('x', size));
+      auto latency = measureLatency(cap, name, io.waitScope);
+      auto throughput = measureThroughput(cap, name, io.waitScope);
+      ctx_.warning(kj::str(
+	"loss=", rate, " size=", size,
+	" calls/s=", static_cast<uint64_t>(throughput),
+	" rtt(ns): ", latency.toString()));
+    }
+  }
+
+  Histogram measureLatency(Hello::Client& cap, kj::StringPtr name, kj::WaitScope& waitScope) {
+    auto& clock = kj::systemPreciseMonotonicClock();
+    Histogram histogram;
+    for (auto ii = 0u; ii < count_; ++ii) {
+      auto req = cap.greetRequest();
+      req.setName(name);
+      auto start = clock.now();
+      req.send().wait(waitScope);
+      histogram.record((clock.now() - start) / kj::NANOSECONDS);
+    }
+    return histogram;
+  }
+
+  double measureThroughput(Hello::Client& cap, kj::StringPtr name, kj::WaitScope& waitScope) {
+    auto& clock = kj::systemPreciseMonotonicClock();
+    auto start = clock.now();
+    for (auto done = 0u; done < count_; done += window_) {
+      auto calls = kj::heapArrayBuilder<kj::Promise<void>>(window_);
+      for (auto ii = 0u; ii < window_; ++ii) {
+	auto req = cap.greetRequest();
+	req.setName(name);
+	calls.add(req.send().ignoreResult());
+      }
+      kj::joinPromises(calls.finish()).wait(waitScope);
+    }
+    auto elapsed = (clock.now() - start) / kj::NANOSECONDS;
+    auto calls = (count_ + window_ - 1) / window_ * window_;
+    return calls * 1e9 / kj::max(elapsed, int64_t{1});
+  }
+
+  kj::ProcessContext& ctx_;
+  kj::Array<double> rates_{kj::heapArray<double>({0.0, 0.001, 0.01, 0.05})};
+  uint32_t count_{10000};
+  uint32_t size_{64 * 1024};
+  uint32_t window_{64};
+};
+
+KJ_MAIN(Bench);
@@ -3,10 +3,16 @@
 //     https://opensource.org/licenses/Apache-2.0
 
 #include "aeron-rpc.h"
+#include "broadcast.h"
+#include "driver.h"
+#include "hedge.h"
+#include "lanes.h"
+#include "pool.h"
+#include "relay.h"
+#include "typed.h"
 #include "hello.capnp.h"
 
 #include <Aeron.h>
-#include <aeronmd/aeronmd.h>
 
 #include <capnp/message.h>
 #include <capnp/rpc-twoparty.h>
@@ -16,6 +22,8 @@
 
 #include <gtest/gtest.h>
 
+#include <unistd.h>
+
 static int EKAM_TEST_DISABLE_INTERCEPTOR = 1;
 
 using namespace aeroncap;
@@ -33,21 +41,6 @@ auto newAeronMessageStream(
 struct AeronRpc
   : testing::Test {
 
-  AeronRpc();
-  ~AeronRpc() noexcept;
-
-
-  bool isRunning() {
-    auto running = running_.lockExclusive();
-    return *running;
-  }
-
-  static void terminationHook(void *state) {
-    KJ_LOG(INFO, "Termination hook called");
-    auto running = static_cast<AeronRpc*>(state)->running_.lockExclusive();
-    *running = false;
-  }
-
   std::shared_ptr<::aeron::ExclusivePublication> newPublisher(int streamId) {
     auto id = aeron_->addExclusivePublication("aeron:ipc", streamId);
     auto pub = aeron_->findExclusivePublication(id);
@@ -70,92 +63,14 @@ struct AeronRpc
   kj::WaitScope& waitScope_{ioCtx_.waitScope};
   kj::Timer& timer_{ioCtx_.provider->getTimer()};
 
-  kj::String driverPath_{kj::str("/tmp/aeron-driver.XXXXXX"_kj)};
-  aeron_driver_context_t* driverContext_{};
-  aeron_driver_t* driver_{};
-  kj::Own<kj::Thread> runner_;
-
-  std::shared_ptr<::aeron::Aeron> aeron_;
-
-  kj::MutexGuarded<bool> running_;
+  // on threads of its own, as the helpers above poll the client in a loop
+  EmbeddedDriver driver_{{.threading = DriverThreading::DEDICATED}};
+  std::shared_ptr<::aeron::Aeron> aeron_{driver_.connect()};
 
   const int count_ = 256;
   const int ttl_ = 0;
 };
 
-AeronRpc::AeronRpc() {
-  //  waitScope_.setBusyPollInterval(32);
-
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wunused-result"
-  mkdtemp(driverPath_.begin());
-#pragma GCC diagnostic pop
-  KJ_LOG(INFO, driverPath_);
-
-  if (aeron_driver_context_init(&driverContext_)) {
-    auto errcode = aeron_errcode();
-    auto errmsg = aeron_errmsg();
-    KJ_FAIL_REQUIRE("aeron_driver_context_init", errcode, errmsg);
-  }
-
-  aeron_driver_context_set_print_configuration(driverContext_, false);
-  aeron_driver_context_set_threading_mode(
-      driverContext_, AERON_THREADING_MODE_DEDICATED);
-  aeron_driver_context_set_dir(driverContext_, driverPath_.cStr());
-  aeron_driver_context_set_dir_delete_on_start(driverContext_, true);
-  aeron_driver_context_set_dir_delete_on_shutdown(driverContext_, true);
-  aeron_driver_context_set_driver_termination_hook(
-      driverContext_, terminationHook, nullptr);
-
-  if (aeron_driver_init(&driver_, driverContext_)) {
-    auto errcode = aeron_errcode();
-    auto errmsg = aeron_errmsg();
-    KJ_FAIL_REQUIRE("aeron_driver_init", errcode, errmsg);
-  }
-  if (aeron_driver_start(driver_, true)) {
-    auto errcode = aeron_errcode();
-    auto errmsg = aeron_errmsg();
-    KJ_FAIL_REQUIRE("aeron_driver_start", errcode, errmsg);
-  }
-  {
-    auto running = running_.lockExclusive();
-    *running = true;
-  }
-  runner_ = kj::heap<kj::Thread>(
-    [this]{
-      while (isRunning()) {
-	auto count = aeron_driver_main_do_work(driver_);
-	aeron_driver_main_idle_strategy(driver_, count);
-      }
-    }
-  );
-  {
-    ::aeron::Context aeronContext;
-    aeronContext.aeronDir(driverPath_.cStr());
-    aeron_ = ::aeron::Aeron::connect(aeronContext);
-  }
-}
-
-AeronRpc::~AeronRpc() noexcept {
-  {
-    auto running = running_.lockExclusive();
-    *running = false;
-  }
-  if (runner_) {
-    runner_ = nullptr;
-  }
-  if (driver_ && aeron_driver_close(driver_)) {
-    auto errcode = aeron_errcode();
-    auto errmsg = aeron_errmsg();
-    KJ_LOG(ERROR, "aeron_driver_close", errcode, errmsg);
-  }
-  if (driverContext_ && aeron_driver_context_close(driverContext_)) {
-    auto errcode = aeron_errcode();
-    auto errmsg = aeron_errmsg();
-    KJ_LOG(ERROR, "aeron_driver_context_close", errcode, errmsg);
-  }
-}
-
 TEST_F(AeronRpc, Basic) {
   auto subA = newSubscriber(1);
   auto pubA = newPublisher(1);
@@ -176,6 +91,28 @@ TEST_F(AeronRpc, Basic) {
   EXPECT_EQ(txt.size(), data.size());
 }
 
+TEST_F(AeronRpc, MultiSegment) {
+  auto subA = newSubscriber(1);
+  auto pubA = newPublisher(1);
+  auto imageA = subA->imageByIndex(0);
+  auto ms = newAeronMessageStream(*pubA, *imageA, timer_);
+
+  capnp::MallocMessageBuilder mb{1, capnp::AllocationStrategy::FIXED_SIZE};
+  auto list = mb.initRoot<capnp::List<capnp::Text>>(4);
+  for (auto ii = 0u; ii < list.size(); ++ii) {
+    list.set(ii, kj::str(ii));
+  }
+  ASSERT_GT(mb.getSegmentsForOutput().size(), 1u);
+
+  ms->writeMessage(nullptr, mb.getSegmentsForOutput()).wait(waitScope_);
+  auto msg = ms->readMessage().wait(waitScope_);
+  auto reply = msg->getRoot<capnp::List<capnp::Text>>();
+  ASSERT_EQ(reply.size(), list.size());
+  for (auto ii = 0u; ii < reply.size(); ++ii) {
+    EXPECT_EQ(reply[ii], kj::str(ii));
+  }
+}
+
 struct HelloServer
   : Hello::Server {
 
@@ -185,6 +122,11 @@ struct HelloServer
     reply.setGreeting("Hello, world!"_kj);
     return kj::READY_NOW;
   }
+
+  kj::Promise<void> another(AnotherContext ctx) {
+    ctx.getResults().setHello(kj::heap<HelloServer>());
+    return kj::READY_NOW;
+  }
 };
 
 TEST_F(AeronRpc, RpcService) {
@@ -226,6 +168,575 @@ TEST_F(AeronRpc, TwoParty) {
   req.send().wait(waitScope_);
 }
 
+TEST_F(AeronRpc, Multiplexed) {
+  Listener listener{timer_, aeron_, "aeron:ipc", 1};
+  Connector connector{timer_, aeron_, "aeron:ipc", 2};
+  TwoPartyServer server{kj::heap<HelloServer>()};
+  auto listening = server.listen(listener);
+  auto session = connector.connectShared("aeron:ipc", 1).wait(waitScope_);
+
+  auto greet = [&session](kj::Timer& timer, kj::WaitScope& waitScope) {
+    auto stream = session->open(timer);
+    TwoPartyClient client{*stream, session->getReaderOptions()};
+    auto cap = client.bootstrap().castAs<Hello>();
+    auto reply = cap.greetRequest().send().wait(waitScope);
+    EXPECT_EQ(reply.getGreeting(), "Hello, world!"_kj);
+  };
+
+  // replies are demultiplexed on this thread, so keep its loop turning
+  // while another thread makes its own calls
+  auto paf = kj::newPromiseAndCrossThreadFulfiller<void>();
+  kj::Thread thread{[&] {
+    auto io = kj::setupAsyncIo();
+    greet(io.provider->getTimer(), io.waitScope);
+    paf.fulfiller->fulfill();
+  }};
+  greet(timer_, waitScope_);
+  paf.promise.wait(waitScope_);
+}
+
+TEST_F(AeronRpc, MultiplexedTimeout) {
+  auto sub = newSubscriber(1);
+  auto pub = newPublisher(1);
+  kj::Own<AeronMessageStreamBase> stream =
+    newAeronMessageStream(*pub, *sub->imageByIndex(0), timer_);
+  stream->setMultiplexed(true);
+
+  // a client that times out takes its image away without ever ending it
+  auto paf = kj::newPromiseAndFulfiller<void>();
+  stream->disconnectWhen(kj::mv(paf.promise));
+  MultiplexedSession session{timer_, kj::mv(stream), [](kj::Own<capnp::MessageStream>) {}};
+  auto disconnected = session.onDisconnect();
+  EXPECT_FALSE(disconnected.poll(waitScope_));
+
+  paf.fulfiller->reject(KJ_EXCEPTION(DISCONNECTED, "Image unavailable"));
+  disconnected.wait(waitScope_);
+}
+
+TEST_F(AeronRpc, EarlyConnect) {
+  Listener listener{timer_, aeron_, "aeron:ipc", 1};
+  Connector connector{timer_, aeron_, "aeron:ipc", 2};
+  TwoPartyServer server{kj::heap<HelloServer>()};
+  auto accepting = listener.accept();
+
+  auto connection = connector.connectEarly("aeron:ipc", 1);
+  TwoPartyClient client{*connection};
+  auto cap = client.bootstrap().castAs<Hello>();
+  auto replying = cap.greetRequest().send();
+
+  // the bootstrap and the pipelined call travel with the Syn
+  auto accepted = accepting.wait(waitScope_);
+  kj::Vector<kj::Own<capnp::MessageReader>> early;
+  while (true) {
+    KJ_IF_MAYBE(msg, accepted->popEarlyMessage()) {
+      early.add(kj::mv(*msg));
+      continue;
+    }
+    break;
+  }
+  EXPECT_GE(early.size(), 2u);
+  for (auto& msg: early) {
+    accepted->pushEarlyMessage(kj::mv(msg));
+  }
+  server.accept(kj::mv(accepted), timer_);
+
+  auto reply = replying.wait(waitScope_);
+  EXPECT_EQ(reply.getGreeting(), "Hello, world!"_kj);
+
+  // and later calls go straight to the stream
+  cap.greetRequest().send().wait(waitScope_);
+}
+
+TEST_F(AeronRpc, Lanes) {
+  Listener listener{timer_, aeron_, "aeron:ipc", 1};
+  Connector connector{timer_, aeron_, "aeron:ipc", 2};
+  TwoPartyServer server{kj::heap<HelloServer>()};
+  auto listening = server.listen(listener);
+
+  PublicationParams lanes[] = {{}, { .termLength = 1024 * 1024 }};
+  auto streams = connector.connectLanes("aeron:ipc", 1, lanes).wait(waitScope_);
+  ASSERT_EQ(streams.size(), 2u);
+  EXPECT_EQ(streams[1]->getPublication().termBufferLength(), 1024 * 1024);
+
+  LanedClient client{kj::mv(streams), 1024};
+  auto cap = client.bootstrap<Hello>();
+
+  auto small = cap.greetRequest();
+  small.setName("small");
+  auto bulk = cap.greetRequest();
+  bulk.setName(kj::str(kj::repeat('x', 4096)));
+  auto replies = kj::joinPromises(kj::arr(
+    small.send().ignoreResult(), bulk.send().ignoreResult()));
+  replies.wait(waitScope_);
+}
+
+TEST_F(AeronRpc, Typed) {
+  Listener listener{timer_, aeron_, "aeron:ipc", 1};
+  Connector connector{timer_, aeron_, "aeron:ipc", 2};
+
+  auto accepted = listener.accept();
+  TypedPublisher<Tick> publisher{connector.connect("aeron:ipc", 1).wait(waitScope_)};
+  TypedSubscriber<Tick> subscriber{accepted.wait(waitScope_)};
+
+  constexpr uint64_t count = 1000;
+  for (auto ii = 0u; ii < count; ++ii) {
+    publisher.publish([ii](auto tick) {
+      tick.setSeq(ii);
+    }).wait(waitScope_);
+  }
+
+  // one too big for a single frame, so fragmented, and a small one that
+  // must not overtake it
+  capnp::MallocMessageBuilder mb;
+  auto big = mb.initRoot<Tick>();
+  big.setSeq(count);
+  big.initPayload(64 * 1024);
+  auto bigPublished = publisher.publish(big.asReader());
+  auto smallPublished = publisher.publish([](auto tick) {
+    tick.setSeq(count + 1);
+  });
+  bigPublished.wait(waitScope_);
+  smallPublished.wait(waitScope_);
+
+  uint64_t expected = 0;
+  while (expected <= count + 1) {
+    subscriber.poll([&](Tick::Reader tick) {
+      EXPECT_EQ(tick.getSeq(), expected++);
+    });
+  }
+  EXPECT_EQ(expected, count + 2);
+
+  // a segment table claiming more than the frame holds is refused
+  uint64_t truncated[] = {uint64_t{100} << 32, 0};
+  auto& pub = publisher.getStream().getPublication();
+  while (!_::tryOffer(pub, kj::arrayPtr(truncated, 2).asBytes())) {}
+  EXPECT_ANY_THROW({
+    while (!subscriber.poll([](Tick::Reader) {})) {}
+  });
+}
+
+TEST_F(AeronRpc, Tracing) {
+  Listener listener{timer_, aeron_, "aeron:ipc", 1};
+  Connector connector{timer_, aeron_, "aeron:ipc", 2};
+  TwoPartyServer server{kj::heap<HelloServer>()};
+  server.enableTracing();
+  auto listening = server.listen(listener);
+
+  auto stream = connector.connect("aeron:ipc", 1).wait(waitScope_);
+  auto& trace = stream->enableTracing();
+  TwoPartyClient client{*stream};
+  auto cap = client.bootstrap().castAs<Hello>();
+
+  constexpr auto count = 10u;
+  for (auto ii = 0u; ii < count; ++ii) {
+    cap.greetRequest().send().wait(waitScope_);
+  }
+
+  // the bootstrap, then a return for each call
+  EXPECT_GE(trace.sendToPoll().count(), count);
+  EXPECT_EQ(trace.sendToPoll().count(), trace.pollToDelivery().count());
+  EXPECT_EQ(trace.gaps(), 0u);
+
+  auto& traces = server.getTraces();
+  ASSERT_EQ(traces.size(), 1u);
+  auto& serverTrace = *traces.begin()->value;
+  EXPECT_GE(serverTrace.sendToPoll().count(), count);
+  KJ_LOG(INFO, "client", trace.toString());
+  KJ_LOG(INFO, "server", serverTrace.toString());
+
+  // multiplexed sessions use the reserved value for stream ids instead
+  auto session = connector.connectShared("aeron:ipc", 1).wait(waitScope_);
+  auto muxStream = session->open(timer_);
+  TwoPartyClient muxClient{*muxStream, session->getReaderOptions()};
+  muxClient.bootstrap().castAs<Hello>().greetRequest().send().wait(waitScope_);
+  EXPECT_EQ(server.getTraces().size(), 1u);
+}
+
+TEST_F(AeronRpc, HandshakeRouter) {
+  HandshakeRouter router{timer_, aeron_};
+  Listener listener{router, "aeron:ipc", 1};
+  TwoPartyServer server{kj::heap<HelloServer>()};
+  auto listening = server.listen(listener);
+
+  // both await their Acks on the same subscription
+  Connector connector1{router, "aeron:ipc", 2};
+  Connector connector2{router, "aeron:ipc", 2};
+  auto connects = kj::joinPromises(kj::arr(
+    connector1.connect("aeron:ipc", 1), connector2.connect("aeron:ipc", 1)));
+  auto streams = connects.wait(waitScope_);
+
+  TwoPartyClient client1{*streams[0]};
+  TwoPartyClient client2{*streams[1]};
+  for (auto client: {&client1, &client2}) {
+    auto cap = client->bootstrap().castAs<Hello>();
+    auto reply = cap.greetRequest().send().wait(waitScope_);
+    EXPECT_EQ(reply.getGreeting(), "Hello, world!"_kj);
+  }
+}
+
+TEST_F(AeronRpc, ConnectionPool) {
+  // two replicas
+  Listener listener1{timer_, aeron_, "aeron:ipc", 1};
+  Listener listener2{timer_, aeron_, "aeron:ipc", 3};
+  TwoPartyServer server{kj::heap<HelloServer>()};
+  auto listening1 = server.listen(listener1);
+  auto listening2 = server.listen(listener2);
+
+  Connector connector{timer_, aeron_, "aeron:ipc", 2};
+  PoolTarget targets[] = {{"aeron:ipc", 1}, {"aeron:ipc", 3}};
+  ConnectionPool pool{timer_, connector, targets, 2};
+
+  // calls made before any connection is up wait for one
+  auto cap = pool.bootstrap<Hello>();
+  auto early = cap.greetRequest().send();
+
+  while (pool.connected() < 4) {
+    timer_.afterDelay(10 * kj::MILLISECONDS).wait(waitScope_);
+  }
+  EXPECT_EQ(early.wait(waitScope_).getGreeting(), "Hello, world!"_kj);
+
+  auto calls = kj::heapArrayBuilder<kj::Promise<void>>(16);
+  for (auto ii = 0u; ii < calls.capacity(); ++ii) {
+    calls.add(cap.greetRequest().send().ignoreResult());
+  }
+  kj::joinPromises(calls.finish()).wait(waitScope_);
+}
+
+TEST_F(AeronRpc, Hedged) {
+  Listener listener1{timer_, aeron_, "aeron:ipc", 1};
+  Listener listener2{timer_, aeron_, "aeron:ipc", 3};
+  TwoPartyServer server{kj::heap<HelloServer>()};
+  auto listening1 = server.listen(listener1);
+  auto listening2 = server.listen(listener2);
+
+  Connector connector{timer_, aeron_, "aeron:ipc", 2};
+  auto primary = connector.connect("aeron:ipc", 1).wait(waitScope_);
+  auto secondary = connector.connect("aeron:ipc", 3).wait(waitScope_);
+  HedgedClient client{timer_, kj::mv(primary), kj::mv(secondary)};
+  auto cap = client.bootstrap<Hello>();
+
+  constexpr auto count = 10u;
+  for (auto ii = 0u; ii < count; ++ii) {
+    auto reply = cap.greetRequest().send().wait(waitScope_);
+    EXPECT_EQ(reply.getGreeting(), "Hello, world!"_kj);
+  }
+
+  auto& stats = client.getStats();
+  EXPECT_EQ(stats.calls, count);
+  EXPECT_EQ(stats.hedged, count);
+  EXPECT_EQ(stats.primaryWins + stats.secondaryWins, count);
+
+  // answered well within the delay, so never hedged
+  client.setDelay(10 * kj::SECONDS);
+  cap.greetRequest().send().wait(waitScope_);
+  EXPECT_EQ(stats.calls, count + 1);
+  EXPECT_EQ(stats.hedged, count);
+}
+
+TEST_F(AeronRpc, PublicationParams) {
+  PublicationParams params{ .termLength = 128 * 1024, .sparse = false };
+  Listener listener{timer_, aeron_, "aeron:ipc", 1};
+  Connector connector{timer_, aeron_, "aeron:ipc", 2, {}, params};
+  TwoPartyServer server{kj::heap<HelloServer>()};
+  auto listening = server.listen(listener);
+  auto connection = connector.connect("aeron:ipc", 1).wait(waitScope_);
+  auto& pub = connection->getPublication();
+  EXPECT_EQ(static_cast<uint32_t>(pub.termBufferLength()), params.termLength);
+
+  auto window = KJ_ASSERT_NONNULL(connection->getSendBufferSize());
+  EXPECT_GE(window, pub.maxPayloadLength());
+  EXPECT_LE(static_cast<uint32_t>(window), params.termLength);
+
+  // the Listener, with no preferences of its own, took ours, and says so
+  auto& image = connection->getImage();
+  auto& peer = connection->getPeerParams();
+  EXPECT_EQ(peer.termLength, params.termLength);
+  EXPECT_EQ(static_cast<int32_t>(peer.termLength), image.termBufferLength());
+  EXPECT_EQ(static_cast<int32_t>(peer.mtu), image.mtuLength());
+  EXPECT_FALSE(peer.sparse);
+
+  TwoPartyClient client{*connection};
+  auto cap = client.bootstrap().castAs<Hello>();
+  cap.greetRequest().send().wait(waitScope_);
+
+  // the channel's own params win
+  auto other = connector.connect("aeron:ipc?term-length=65536", 1).wait(waitScope_);
+  EXPECT_EQ(other->getPublication().termBufferLength(), 65536);
+}
+
+TEST_F(AeronRpc, Broadcast) {
+  auto subA = newSubscriber(3);
+  auto subB = newSubscriber(3);
+  auto pub = newPublisher(3);
+  auto writeIdler = idle::backoff(timer_);
+  AeronBroadcastStream broadcast{*pub, writeIdler};
+
+  capnp::MallocMessageBuilder mb;
+  auto data = mb.initRoot<capnp::Text>(16u);
+  memset(data.begin(), 'a', data.size());
+  broadcast.writeSnapshot(mb).wait(waitScope_);
+  EXPECT_EQ(broadcast.snapshotPosition(), pub->position());
+
+  for (auto& sub: {subA, subB}) {
+    auto readIdler = idle::periodic(timer_, kj::NANOSECONDS);
+    auto msg = readMessage(readIdler, *sub->imageByIndex(0)).wait(waitScope_);
+    EXPECT_EQ(msg->getRoot<capnp::Text>().size(), data.size());
+  }
+
+  // a joiner whose image is ahead of the latest snapshot waits for the next
+  auto subD = newSubscriber(3);
+  auto imageD = subD->imageByIndex(0);
+  auto subC = newSubscriber(4);
+  auto pubC = newPublisher(4);
+  auto imageC = subC->imageByIndex(0);
+  auto msC = newAeronMessageStream(*pubC, *imageC, timer_);
+  auto joining = broadcast.join(*msC, imageD->joinPosition() + 1);
+  EXPECT_FALSE(joining.poll(waitScope_));
+
+  // and gets it over its own stream, even if messages follow the snapshot
+  // before its write resolves
+  auto snapshotting = broadcast.writeSnapshot(mb);
+  capnp::MallocMessageBuilder update;
+  update.initRoot<capnp::Text>(8u);
+  broadcast.writeMessage(update).wait(waitScope_);
+  snapshotting.wait(waitScope_);
+  EXPECT_LT(broadcast.snapshotPosition(), pub->position());
+
+  joining.wait(waitScope_);
+  auto joined = readSnapshot(*msC).wait(waitScope_);
+  EXPECT_EQ(joined.snapshot->getRoot<capnp::Text>().size(), data.size());
+  EXPECT_EQ(joined.position, broadcast.snapshotPosition());
+
+  // then skips what the snapshot reflects, and reads on from there, the
+  // message that followed it included
+  auto readIdler = idle::periodic(timer_, kj::NANOSECONDS);
+  skipTo(readIdler, *imageD, joined.position).wait(waitScope_);
+  auto msg = readMessage(readIdler, *imageD).wait(waitScope_);
+  EXPECT_EQ(msg->getRoot<capnp::Text>().size(), 8u);
+}
+
+TEST_F(AeronRpc, EmbeddedDriver) {
+  // a driver of its own, running in this event loop alongside the client
+  // and server
+  auto idler = idle::backoff(timer_);
+  EmbeddedDriver driver{idler};
+  auto aeron = driver.connect();
+
+  Listener listener{timer_, aeron, "aeron:ipc", 1};
+  Connector connector{timer_, aeron, "aeron:ipc", 2};
+  TwoPartyServer server{kj::heap<HelloServer>()};
+  auto listening = server.listen(listener);
+  auto connection = connector.connect("aeron:ipc", 1).wait(waitScope_);
+  TwoPartyClient client{*connection};
+  auto cap = client.bootstrap().castAs<Hello>();
+  auto reply = cap.greetRequest().send().wait(waitScope_);
+  EXPECT_EQ(reply.getGreeting(), "Hello, world!"_kj);
+}
+
+TEST_F(AeronRpc, Blobs) {
+  auto subA = newSubscriber(1);
+  auto pubA = newPublisher(1);
+  auto imageA = subA->imageByIndex(0);
+  auto ms = newAeronMessageStream(*pubA, *imageA, timer_);
+
+  auto name = kj::str("/aeron-capnp-test-", getpid());
+  auto pool = BlobPool::create(name, 2, 1 << 20);
+  EXPECT_ANY_THROW(BlobPool::create(name, 2, 1 << 20));
+
+  // not until the peer agrees to read handles
+  EXPECT_ANY_THROW(ms->enableBlobs(kj::addRef(*pool), 64 * 1024));
+  ms->acceptBlobs("/aeron-capnp-test-");
+  ms->setPeerAcceptsBlobs(true);
+  ms->enableBlobs(kj::addRef(*pool), 64 * 1024);
+
+  {
+    capnp::MallocMessageBuilder mb;
+    auto data = mb.initRoot<capnp::Data>(512 * 1024);
+    for (auto ii = 0u; ii < data.size(); ++ii) {
+      data[ii] = ii % 251;
+    }
+    ms->writeMessage(nullptr, mb.getSegmentsForOutput()).wait(waitScope_);
+    EXPECT_EQ(pool->inUse(), 1u);
+
+    auto msg = ms->readMessage().wait(waitScope_);
+    EXPECT_EQ(msg->getRoot<capnp::Data>(), data.asReader());
+    EXPECT_EQ(pool->inUse(), 1u);
+  }
+  EXPECT_EQ(pool->inUse(), 0u);
+
+  {
+    // small messages go the usual way
+    capnp::MallocMessageBuilder mb;
+    mb.initRoot<capnp::Text>(16u);
+    ms->writeMessage(nullptr, mb.getSegmentsForOutput()).wait(waitScope_);
+    EXPECT_EQ(pool->inUse(), 0u);
+    auto msg = ms->readMessage().wait(waitScope_);
+    EXPECT_EQ(msg->getRoot<capnp::Text>().size(), 16u);
+  }
+}
+
+TEST_F(AeronRpc, Instrumentation) {
+  Listener listener{timer_, aeron_, "aeron:ipc", 1};
+  Connector connector{timer_, aeron_, "aeron:ipc", 2};
+  TwoPartyServer server{kj::heap<HelloServer>()};
+  auto& instrumentation = server.enableInstrumentation();
+  auto listening = server.listen(listener);
+
+  auto stream = connector.connect("aeron:ipc", 1).wait(waitScope_);
+  TwoPartyClient client{*stream};
+  auto cap = client.bootstrap().castAs<Hello>();
+
+  constexpr auto count = 10u;
+  for (auto ii = 0u; ii < count; ++ii) {
+    auto reply = cap.greetRequest().send().wait(waitScope_);
+    EXPECT_EQ(reply.getGreeting(), "Hello, world!"_kj);
+  }
+
+  // calls on a returned capability are counted too
+  auto another = cap.anotherRequest().send().wait(waitScope_).getHello();
+  another.greetRequest().send().wait(waitScope_);
+
+  auto snapshot = instrumentation.snapshot();
+  ASSERT_EQ(snapshot.size(), 2u);
+  auto find = [&](uint16_t id) -> Instrumentation::Method& {
+    for (auto& method: snapshot) {
+      if (method.methodId == id) {
+	return method;
+      }
+    }
+    KJ_FAIL_ASSERT("No calls recorded", id);
+  };
+
+  auto& method = find(0);
+  EXPECT_EQ(method.interfaceId, capnp::typeId<Hello>());
+  EXPECT_EQ(method.calls, count + 1);
+  EXPECT_EQ(method.failures, 0u);
+  EXPECT_EQ(method.executionTime.count(), count + 1);
+  EXPECT_GT(method.responseSize.min(), 0u);
+  KJ_LOG(INFO, method.executionTime.toString());
+
+  EXPECT_EQ(find(1).calls, 1u);
+
+  instrumentation.reset();
+  EXPECT_EQ(instrumentation.snapshot().size(), 0u);
+}
+
+TEST_F(AeronRpc, IdleReaper) {
+  Listener listener{timer_, aeron_, "aeron:ipc", 1};
+  Connector connector{timer_, aeron_, "aeron:ipc", 2};
+  TwoPartyServer server{kj::heap<HelloServer>()};
+  server.reapIdle(timer_, 50 * kj::MILLISECONDS);
+  auto listening = server.listen(listener);
+
+  uint64_t termLength = 0;
+  {
+    auto stream = connector.connect("aeron:ipc", 1).wait(waitScope_);
+    TwoPartyClient client{*stream};
+    auto cap = client.bootstrap().castAs<Hello>();
+    cap.greetRequest().send().wait(waitScope_);
+    // the server's publication, the only log buffers reclaimed
+    termLength = stream->getImage().termBufferLength();
+
+    while (server.getIdleStats().reaped == 0) {
+      timer_.afterDelay(10 * kj::MILLISECONDS).wait(waitScope_);
+    }
+  }
+  EXPECT_EQ(server.getIdleStats().reaped, 1u);
+  using ::aeron::concurrent::logbuffer::LogBufferDescriptor::PARTITION_COUNT;
+  EXPECT_EQ(server.getIdleStats().bytesReclaimed, termLength * PARTITION_COUNT);
+
+  // a client that comes back connects afresh
+  auto stream = connector.connect("aeron:ipc", 1).wait(waitScope_);
+  TwoPartyClient client{*stream};
+  auto cap = client.bootstrap().castAs<Hello>();
+  auto reply = cap.greetRequest().send().wait(waitScope_);
+  EXPECT_EQ(reply.getGreeting(), "Hello, world!"_kj);
+}
+
+TEST_F(AeronRpc, Relay) {
+  auto subA = newSubscriber(1);
+  auto pubA = newPublisher(1);
+  auto subB = newSubscriber(2);
+  auto pubB = newPublisher(2);
+  auto imageA = subA->imageByIndex(0);
+  auto imageB = subB->imageByIndex(0);
+  auto in = newAeronMessageStream(*pubA, *imageA, timer_);
+  auto out = newAeronMessageStream(*pubB, *imageB, timer_);
+
+  // small, and fragmented
+  for (auto size: {16u, 64u * 1024u}) {
+    capnp::MallocMessageBuilder mb;
+    auto data = mb.initRoot<capnp::Data>(size);
+    for (auto ii = 0u; ii < data.size(); ++ii) {
+      data[ii] = ii % 251;
+    }
+    in->writeMessage(nullptr, mb.getSegmentsForOutput()).wait(waitScope_);
+  }
+
+  auto relaying = relay(*in, *out).eagerlyEvaluate(nullptr);
+
+  for (auto size: {16u, 64u * 1024u}) {
+    auto msg = out->readMessage().wait(waitScope_);
+    auto data = msg->getRoot<capnp::Data>();
+    ASSERT_EQ(data.size(), size);
+    for (auto ii = 0u; ii < data.size(); ++ii) {
+      ASSERT_EQ(data[ii], ii % 251);
+    }
+  }
+}
+
+struct CountingHelloServer
+  : Hello::Server {
+
+  kj::Promise<void> greet(GreetContext ctx) override {
+    ++calls;
+    ctx.getResults().setGreeting(kj::str("Hello, ", ctx.getParams().getName()));
+    return kj::READY_NOW;
+  }
+
+  uint32_t calls{0};
+};
+
+TEST_F(AeronRpc, ResponseCache) {
+  auto hello = kj::heap<CountingHelloServer>();
+  auto& counter = *hello;
+  Listener listener{timer_, aeron_, "aeron:ipc", 1};
+  Connector connector{timer_, aeron_, "aeron:ipc", 2};
+  TwoPartyServer server{kj::mv(hello)};
+  auto& cache = server.enableCache<Hello>(timer_);
+  auto listening = server.listen(listener);
+
+  // two connections, sharing the cache
+  auto stream1 = connector.connect("aeron:ipc", 1).wait(waitScope_);
+  auto stream2 = connector.connect("aeron:ipc", 1).wait(waitScope_);
+  TwoPartyClient client1{*stream1};
+  TwoPartyClient client2{*stream2};
+  auto cap1 = client1.bootstrap().castAs<Hello>();
+  auto cap2 = client2.bootstrap().castAs<Hello>();
+
+  auto greet = [this](Hello::Client& cap, kj::StringPtr name) {
+    auto req = cap.greetRequest();
+    req.setName(name);
+    return kj::str(req.send().wait(waitScope_).getGreeting());
+  };
+
+  EXPECT_EQ(greet(cap1, "world"), "Hello, world");
+  EXPECT_EQ(greet(cap2, "world"), "Hello, world");
+  EXPECT_EQ(greet(cap1, "world"), "Hello, world");
+  EXPECT_EQ(greet(cap2, "there"), "Hello, there");
+  EXPECT_EQ(counter.calls, 2u);
+
+  auto& stats = cache.getStats();
+  EXPECT_EQ(stats.hits, 2u);
+  EXPECT_EQ(stats.misses, 2u);
+  EXPECT_EQ(stats.entries, 2u);
+  EXPECT_GT(stats.bytes, 0u);
+
+  cache.clear();
+  EXPECT_EQ(greet(cap1, "world"), "Hello, world");
+  EXPECT_EQ(counter.calls, 3u);
+}
+
 int main(int argc, char* argv[]) {
   kj::TopLevelProcessContext processCtx{argv[0]};
   processCtx.increaseLoggingVerbosity();
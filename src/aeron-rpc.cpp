@@ -8,52 +8,28 @@
 #include "serialize.h"
 
 #include <capnp/serialize.h>
-#include <kj/list.h>
 
 namespace aeroncap {
 
 namespace {
 
-template <typename T>
-struct Queue {
-  Queue() {}
-
-  ~Queue() {
-    while (!empty()) {
-      pop();
-    }
-  }
-
-  bool empty() const {
-    return items.empty();
-  }
-
-  size_t size() const {
-    return items.size();
-  }
-  
-  void push(T&& element) {
-    auto entry = new Entry{ .item = kj::mv(element) };
-    items.add(*entry);
-  }
-
-  T pop() {
-    KJ_IREQUIRE(!empty());
-    auto& entry = items.front();
-    items.remove(entry);
-    auto item = kj::mv(entry.item);
-    delete &entry;
-    return item;
-  }
-
-private:
-  struct Entry {
-    kj::ListLink<Entry> link;
-    T item;
+PublicationParams fromCapnp(aeron::PublicationParams::Reader params) {
+  return {
+    .termLength = params.getTermLength(),
+    .mtu = params.getMtu(),
+    .sparse = params.getSparse(),
+    .socketSndbufLength = params.getSocketSndbufLength(),
+    .socketRcvbufLength = params.getSocketRcvbufLength()
   };
+}
 
-  kj::List<Entry, &Entry::link> items;
-};
+void toCapnp(PublicationParams const& params, aeron::PublicationParams::Builder builder) {
+  builder.setTermLength(params.termLength);
+  builder.setMtu(params.mtu);
+  builder.setSparse(params.sparse);
+  builder.setSocketSndbufLength(params.socketSndbufLength);
+  builder.setSocketRcvbufLength(params.socketRcvbufLength);
+}
 
 }
 
@@ -70,19 +46,38 @@ struct ImageReceiver {
 
   template <typename Idler>
   kj::Promise<::aeron::Image> receive(Idler& idler) {
+    while (true) {
+      KJ_IF_MAYBE(image, tryReceive()) {
+	co_return kj::mv(*image);
+      }
+      co_await idler.idle();
+    }
+  }
+
+  kj::Maybe<::aeron::Image> tryReceive() {
     auto queue = acceptQueue_.lockExclusive();
-    if (!queue->empty()) {
-      return queue->pop();
+    if (queue->empty()) {
+      return nullptr;
     }
-    return idler.idle()
-      .then([this, &idler]{
-	return receive(idler);
-      });
+    return queue->pop();
   }
 
+  // Rejects with DISCONNECTED as soon as the image of the given session
+  // becomes unavailable, e.g. because its publication was closed or timed
+  // out, rather than when a reader next polls it.
+  kj::Promise<void> onUnavailable(int32_t sessionId);
+
   std::shared_ptr<::aeron::Aeron> aeron_;
   uint64_t subId_;
   kj::MutexGuarded<Queue<::aeron::Image>> acceptQueue_;
+
+  struct Watchers {
+    kj::HashMap<int32_t, kj::Own<kj::CrossThreadPromiseFulfiller<void>>> fulfillers;
+    // sessions whose images are still available, so only as many as there
+    // are connections
+    kj::HashSet<int32_t> available;
+  };
+  kj::MutexGuarded<Watchers> watchers_;
 };
 
 ImageReceiver::ImageReceiver(
@@ -93,218 +88,678 @@ ImageReceiver::ImageReceiver(
   subId_ = aeron.addSubscription(
     channel.cStr(),
     streamId,
+    // both called on the client conductor thread
     [this](auto image) {
+      watchers_.lockExclusive()->available.upsert(image.sessionId(), [](auto&, auto&&) {});
       auto queue = acceptQueue_.lockExclusive();
       queue->push(kj::mv(image));
     },
-    [](auto) {}
+    [this](auto& image) {
+      auto sessionId = image.sessionId();
+      auto watchers = watchers_.lockExclusive();
+      watchers->available.erase(sessionId);
+      KJ_IF_MAYBE(fulfiller, watchers->fulfillers.find(sessionId)) {
+	(*fulfiller)->reject(KJ_EXCEPTION(DISCONNECTED, "Image unavailable", sessionId));
+	watchers->fulfillers.erase(sessionId);
+      }
+    }
   );
 }
 
+kj::Promise<void> ImageReceiver::onUnavailable(int32_t sessionId) {
+  auto watchers = watchers_.lockExclusive();
+  if (!watchers->available.contains(sessionId)) {
+    // lost before anyone asked
+    return KJ_EXCEPTION(DISCONNECTED, "Image unavailable", sessionId);
+  }
+
+  // forget those whose streams have already gone
+  watchers->fulfillers.eraseAll([](auto&, auto& fulfiller) {
+    return !fulfiller->isWaiting();
+  });
+
+  auto paf = kj::newPromiseAndCrossThreadFulfiller<void>();
+  watchers->fulfillers.upsert(
+    sessionId, kj::mv(paf.fulfiller),
+    [](auto& existing, auto&& replacement) {
+      existing = kj::mv(replacement);
+    });
+  return kj::mv(paf.promise);
+}
+
 ImageReceiver::~ImageReceiver() {
 }
 
+// The image of an acknowledged session, whether the Listener reads blob
+// handles on it, and the params of the publication behind the image.
+struct AckedImage {
+  ::aeron::Image image;
+  bool blobs;
+  PublicationParams params;
+};
+
+// Reads the Ack at the start of each image on a response channel, and
+// hands the image to whichever Connector is awaiting the session it
+// acknowledges.
+struct ResponseRouter {
+
+  ResponseRouter(
+    kj::Timer& timer,
+    ::aeron::Aeron& aeron,
+    kj::StringPtr channel,
+    int32_t streamId)
+    : timer_{timer}
+    , receiver_{kj::heap<ImageReceiver>(aeron, channel, streamId)}
+    , task_{handleResponses().eagerlyEvaluate([](kj::Exception&& exc) {
+	KJ_LOG(ERROR, exc);
+      })} {
+  }
+
+  ~ResponseRouter() {
+    for (auto& f: fulfillers_) {
+      f.value->reject(KJ_EXCEPTION(FAILED, "Response router destroyed"));
+    }
+  }
+
+  kj::Promise<AckedImage> awaitAck(int32_t sessionId) {
+    // forget those whose connects were abandoned
+    fulfillers_.eraseAll([](auto&, auto& fulfiller) {
+      return !fulfiller->isWaiting();
+    });
+
+    auto paf = kj::newPromiseAndFulfiller<AckedImage>();
+    fulfillers_.upsert(
+      sessionId, kj::mv(paf.fulfiller),
+      [](auto& existing, auto&& replacement) {
+	existing = kj::mv(replacement);
+      });
+    return kj::mv(paf.promise);
+  }
+
+  ImageReceiver& receiver() { return *receiver_; }
+
+private:
+  kj::Promise<void> handleResponses() {
+    auto idler = idle::backoff(timer_);
+    while (true) {
+      try {
+	auto image = co_await receiver_->receive(idler);
+	idler.reset();
+	KJ_LOG(INFO, image.sourceIdentity(), image.sessionId());
+
+	auto reader = co_await readMessage(idler, image)
+	  .exclusiveJoin(receiver_->onUnavailable(image.sessionId())
+	    .then([]() -> kj::Own<capnp::MessageReader> { KJ_UNREACHABLE; }));
+	auto ack = reader->getRoot<aeron::Ack>();
+	auto sessionId = ack.getSessionId();
+	KJ_LOG(INFO, "Connector < ACK", sessionId, ack.getBlobs(), ack.getParams());
+	KJ_IF_MAYBE(f, fulfillers_.find(sessionId)) {
+	  (*f)->fulfill(AckedImage{kj::mv(image), ack.getBlobs(), fromCapnp(ack.getParams())});
+	  fulfillers_.erase(sessionId);
+	}
+	else {
+	  // drop it like it's hot
+	  KJ_LOG(ERROR, "Received unknown ACK", sessionId);
+	}
+      }
+      catch (...) {
+	KJ_LOG(ERROR, "Failed to accept connection", kj::getCaughtExceptionAsKj());
+      }
+      idler.reset();
+    }
+  }
+
+  kj::Timer& timer_;
+  kj::Own<ImageReceiver> receiver_;
+  kj::HashMap<int32_t, kj::Own<kj::PromiseFulfiller<AckedImage>>> fulfillers_;
+  kj::Promise<void> task_;
+};
+
 }
 
 namespace {
 
-template <typename Idler>
-kj::Promise<void> offerMessage(
-    ::aeron::ExclusivePublication& pub,
-    kj::ArrayPtr<capnp::byte> bytes,
-    Idler& idler) {
+template <typename Publication, typename Idler>
+kj::Promise<std::shared_ptr<Publication>> findPublication(
+  ::aeron::Aeron& aeron, int64_t pubId, Idler& idler) {
 
-  if (auto err = pub.offer({bytes.begin(), bytes.size()}); err > 0) {
-    return kj::READY_NOW;
+  while (true) {
+    std::shared_ptr<Publication> pub;
+    if constexpr (std::is_same_v<Publication, ::aeron::ExclusivePublication>) {
+      pub = aeron.findExclusivePublication(pubId);
+    }
+    else {
+      pub = aeron.findPublication(pubId);
+    }
+    if (pub) {
+      co_return pub;
+    }
+    co_await idler.idle();
   }
-  else if (err == ::aeron::ADMIN_ACTION || err == ::aeron::BACK_PRESSURED) {
-    return idler.idle().then([&pub, bytes, &idler] {
-      return offerMessage(pub, bytes, idler);
-    });
+}
+
+kj::Maybe<kj::String> getParam(kj::StringPtr channel, kj::StringPtr key) {
+  for (auto sep: {'?', '|'}) {
+    auto prefix = kj::str(sep, key, '=');
+    if (auto found = strstr(channel.cStr(), prefix.cStr())) {
+      auto value = found + prefix.size();
+      auto end = strchr(value, '|');
+      return end ? kj::heapString(value, end - value) : kj::heapString(value);
+    }
   }
-  else {
-    kj::throwFatalException(toException(err));
+  return nullptr;
+}
+
+bool hasParam(kj::StringPtr channel, kj::StringPtr key) {
+  return getParam(channel, key) != nullptr;
+}
+
+// A length param, with any k, m or g suffix.
+uint32_t parseLength(kj::StringPtr value) {
+  char* end;
+  auto length = strtoull(value.cStr(), &end, 10);
+  switch (*end) {
+  case 'k': case 'K': length <<= 10; break;
+  case 'm': case 'M': length <<= 20; break;
+  case 'g': case 'G': length <<= 30; break;
+  }
+  return static_cast<uint32_t>(length);
+}
+
+// Params already in the channel URI take precedence over these.
+kj::String withParams(kj::StringPtr channel, PublicationParams const& params) {
+  kj::Vector<kj::String> opts;
+  auto add = [&](kj::StringPtr key, auto value) {
+    if (!hasParam(channel, key)) {
+      opts.add(kj::str(key, '=', value));
+    }
+  };
+  if (params.termLength) {
+    add("term-length", params.termLength);
+  }
+  if (params.mtu) {
+    add("mtu", params.mtu);
+  }
+  if (!params.sparse) {
+    add("sparse", "false");
+  }
+  // socket buffers only apply to network channels
+  if (channel.startsWith("aeron:udp")) {
+    if (params.socketSndbufLength) {
+      add("so-sndbuf", params.socketSndbufLength);
+    }
+    if (params.socketRcvbufLength) {
+      add("so-rcvbuf", params.socketRcvbufLength);
+    }
+  }
+  if (opts.empty()) {
+    return kj::str(channel);
+  }
+  auto sep = channel.findFirst('?') == nullptr ? "?" : "|";
+  return kj::str(channel, sep, kj::strArray(opts, "|"));
+}
+
+// The params a publication was created with: the lengths the driver gave
+// it, and the rest as set by its channel URI, into which `withParams`
+// merged the params asked for.
+template <typename Publication>
+PublicationParams appliedParams(Publication& pub) {
+  kj::StringPtr channel = pub.channel().c_str();
+  PublicationParams params{
+    .termLength = static_cast<uint32_t>(pub.termBufferLength()),
+    .mtu = static_cast<uint32_t>(pub.maxPayloadLength() + ::aeron::DataFrameHeader::LENGTH)
+  };
+  KJ_IF_MAYBE(sparse, getParam(channel, "sparse")) {
+    params.sparse = *sparse != "false";
+  }
+  KJ_IF_MAYBE(sndbuf, getParam(channel, "so-sndbuf")) {
+    params.socketSndbufLength = parseLength(*sndbuf);
   }
+  KJ_IF_MAYBE(rcvbuf, getParam(channel, "so-rcvbuf")) {
+    params.socketRcvbufLength = parseLength(*rcvbuf);
+  }
+  return params;
 }
 
-template <typename Idler>
-kj::Promise<void> offerMessage(
-  ::aeron::ExclusivePublication& pub,
-  capnp::MessageBuilder& mb, Idler& idler) {
-  auto words = capnp::messageToFlatArray(mb);
-  auto bytes = words.asBytes();
-  return offerMessage(pub, bytes, idler).attach(kj::mv(words));
+// Our own preferences take precedence over the peer's
+PublicationParams merge(PublicationParams const& ours, PublicationParams const& theirs) {
+  auto pick = [](uint32_t lhs, uint32_t rhs) { return lhs ? lhs : rhs; };
+  return {
+    .termLength = pick(ours.termLength, theirs.termLength),
+    .mtu = pick(ours.mtu, theirs.mtu),
+    .sparse = ours.sparse && theirs.sparse,
+    .socketSndbufLength = pick(ours.socketSndbufLength, theirs.socketSndbufLength),
+    .socketRcvbufLength = pick(ours.socketRcvbufLength, theirs.socketRcvbufLength)
+  };
 }
 
-template <typename Idler>
-kj::Promise<std::shared_ptr<::aeron::ExclusivePublication>> findPublication(
-  ::aeron::Aeron& aeron, int32_t pubId, Idler& idler) {
+template <typename Publication = ::aeron::ExclusivePublication, typename Idler>
+kj::Promise<std::shared_ptr<Publication>> addPublication(
+  ::aeron::Aeron& aeron, kj::StringPtr channel, int32_t streamId,
+  PublicationParams const& params, Idler& idler) {
+  auto uri = withParams(channel, params);
+  if constexpr (std::is_same_v<Publication, ::aeron::ExclusivePublication>) {
+    auto pubId = aeron.addExclusivePublication(uri.cStr(), streamId);
+    return findPublication<Publication>(aeron, pubId, idler);
+  }
+  else {
+    auto pubId = aeron.addPublication(uri.cStr(), streamId);
+    return findPublication<Publication>(aeron, pubId, idler);
+  }
+}
 
-  if (auto pub = aeron.findExclusivePublication(pubId)) {
-    return pub;
+template <typename Publication, typename Idler>
+kj::Promise<void> writeSyn(
+  Idler& idler, Publication& pub,
+  kj::StringPtr channel, int32_t streamId,
+  PublicationParams const& params, bool multiplexed,
+  kj::ArrayPtr<kj::Array<capnp::word> const> messages = nullptr,
+  uint8_t lane = 0, bool blobs = false) {
+
+  capnp::MallocMessageBuilder mb{capnp::sizeInWords<aeron::Syn>()};
+  auto syn = mb.initRoot<aeron::Syn>();
+  syn.setChannel(channel);
+  syn.setStreamId(streamId);
+  toCapnp(params, syn.initParams());
+  syn.setMultiplexed(multiplexed);
+  syn.setLane(lane);
+  syn.setBlobs(blobs);
+  if (messages.size()) {
+    auto list = syn.initMessages(messages.size());
+    for (auto ii = 0u; ii < messages.size(); ++ii) {
+      list.set(ii, messages[ii].asBytes());
+    }
   }
+  KJ_LOG(INFO, "Connector > SYN", channel, streamId, multiplexed, messages.size());
+  co_await writeMessage(idler, pub, mb.getSegmentsForOutput());
+}
+
+kj::Own<AeronMessageStreamBase> newMessageStream(
+  kj::Timer& timer,
+  _::ImageReceiver& receiver,
+  std::shared_ptr<::aeron::ExclusivePublication> pub,
+  ::aeron::Image image,
+  capnp::ReaderOptions options) {
+  auto unavailable = receiver.onUnavailable(image.sessionId());
+  using Stream = BasicAeronMessageStream<idle::PeriodicIdler, idle::BackoffIdler>;
+  kj::Own<AeronMessageStreamBase> stream = kj::heap<Stream>(
+    *pub, kj::mv(image),
+    idle::periodic(timer, kj::NANOSECONDS), idle::backoff(timer),
+    options
+  ).attach(kj::mv(pub));
+  stream->disconnectWhen(kj::mv(unavailable));
+  return stream;
+}
 
-  return idler.idle().then([&aeron, pubId, &idler]() mutable {
-    return findPublication(aeron, pubId, idler);
-  });
 }
 
-template <typename Idler>
-kj::Promise<std::shared_ptr<::aeron::ExclusivePublication>> addPublication(
-  ::aeron::Aeron& aeron, kj::StringPtr channel, int32_t streamId, Idler& idler) {
-  auto pubId = aeron.addExclusivePublication(channel.cStr(), streamId);
-  return findPublication(aeron, pubId, idler);
+HandshakeRouter::HandshakeRouter(
+  kj::Timer& timer,
+  std::shared_ptr<::aeron::Aeron> aeron)
+  : timer_{timer}
+  , aeron_{kj::mv(aeron)} {
 }
 
+HandshakeRouter::~HandshakeRouter() {
+}
+
+namespace {
+
+kj::String routeKey(kj::StringPtr channel, int32_t streamId) {
+  return kj::str(streamId, ':', channel);
+}
+
+}
+
+_::ResponseRouter& HandshakeRouter::responses(kj::StringPtr channel, int32_t streamId) {
+  return *responses_.findOrCreate(routeKey(channel, streamId), [&]() {
+    auto router = kj::heap<_::ResponseRouter>(timer_, *aeron_, channel, streamId);
+    return decltype(responses_)::Entry{routeKey(channel, streamId), kj::mv(router)};
+  });
+}
+
+_::ImageReceiver& HandshakeRouter::receiver(kj::StringPtr channel, int32_t streamId) {
+  return *receivers_.findOrCreate(routeKey(channel, streamId), [&]() {
+    auto receiver = kj::heap<_::ImageReceiver>(*aeron_, channel, streamId);
+    return decltype(receivers_)::Entry{routeKey(channel, streamId), kj::mv(receiver)};
+  });
 }
 
 Connector::Connector(
   kj::Timer& timer,
   std::shared_ptr<::aeron::Aeron> aeron,
   kj::StringPtr channel,
-  int32_t streamId)
+  int32_t streamId,
+  capnp::ReaderOptions options,
+  PublicationParams params)
   : aeron_{kj::mv(aeron)}
-  , receiver_{kj::heap<_::ImageReceiver>(*aeron_, channel, streamId)}
+  , responses_{kj::heap<_::ResponseRouter>(timer, *aeron_, channel, streamId)}
   , timer_{timer}
-  , tasks_{*this}
   , channel_{kj::str(channel)}
-  , streamId_{streamId} {
-  tasks_.add(canceler_.wrap(handleResponses()));
+  , streamId_{streamId}
+  , options_{options}
+  , params_{params} {
+}
+
+Connector::Connector(
+  HandshakeRouter& router,
+  kj::StringPtr channel,
+  int32_t streamId,
+  capnp::ReaderOptions options,
+  PublicationParams params)
+  : aeron_{router.aeron_}
+  , responses_{kj::Own<_::ResponseRouter>(
+      &router.responses(channel, streamId), kj::NullDisposer::instance)}
+  , timer_{router.timer_}
+  , channel_{kj::str(channel)}
+  , streamId_{streamId}
+  , options_{options}
+  , params_{params} {
 }
 
 Connector::~Connector() {
-  for (auto& f: fulfillers_) {
-    f.value->reject(KJ_EXCEPTION(FAILED, "Connector destroyed"));
-  }
+  canceler_.cancel(KJ_EXCEPTION(FAILED, "Connector destroyed"));
 }
 
-kj::Promise<void> Connector::handleResponses() {
-  auto idler = kj::attachVal(idle::backoff(timer_));
-  return receiver_->receive(*idler).attach(kj::mv(idler))
-    .then(
-      [this](auto image) -> kj::Promise<void> {
-	KJ_LOG(INFO, image.sourceIdentity(), image.sessionId());
-	auto idler = kj::attachVal(idle::backoff(timer_));
-	return readMessage(*idler, image).attach(kj::mv(idler))
-	  .then(
-	    [this, image = kj::mv(image)](auto reader) mutable {
-	      auto ack = reader->template getRoot<aeron::Ack>();
-	      auto sessionId = ack.getSessionId();
-	      KJ_LOG(INFO, "Connector < ACK", sessionId);
-	      KJ_IF_MAYBE(f, fulfillers_.find(sessionId)) {
-		(*f)->fulfill(kj::mv(image));
-		fulfillers_.erase(sessionId);
-	      }
-	      else {
-		// drop it like it's hot
-		KJ_LOG(ERROR, "Received unknown ACK", sessionId);
-	      }
-	    }
-	  );
-      }
-    )
-    .catch_(
-      [](auto&& exc) {
-	KJ_LOG(ERROR, "Failed to accept connection", exc);
-      }
-    )
-    .then(
-      [this] {
-	return handleResponses();
-      }
-    );
+kj::Promise<_::AckedImage> Connector::awaitAck(int32_t sessionId) {
+  return canceler_.wrap(responses_->awaitAck(sessionId));
 }
 
-void Connector::taskFailed(kj::Exception&& exc) {
-  KJ_LOG(ERROR, exc);
+void Connector::acceptBlobs(kj::StringPtr poolPrefix) {
+  KJ_REQUIRE(channel_.startsWith("aeron:ipc"),
+	     "Blobs need both ends on the same host", channel_);
+  blobPrefix_ = kj::str(poolPrefix);
+}
+
+kj::Promise<kj::Own<AeronMessageStreamBase>> Connector::connect(
+    kj::StringPtr channel, int32_t streamId) {
+  return connectLane(channel, streamId, params_, 0);
+}
+
+kj::Promise<kj::Array<kj::Own<AeronMessageStreamBase>>> Connector::connectLanes(
+    kj::StringPtr channel, int32_t streamId,
+    kj::ArrayPtr<PublicationParams const> lanes) {
+  KJ_REQUIRE(lanes.size() > 0 && lanes.size() <= std::numeric_limits<uint8_t>::max() + 1u, lanes.size());
+
+  auto promises = kj::heapArrayBuilder<kj::Promise<kj::Own<AeronMessageStreamBase>>>(lanes.size());
+  for (auto ii = 0u; ii < lanes.size(); ++ii) {
+    promises.add(connectLane(channel, streamId, lanes[ii], ii));
+  }
+  return kj::joinPromises(promises.finish());
+}
+
+kj::Promise<kj::Own<AeronMessageStreamBase>> Connector::connectLane(
+    kj::StringPtr channel, int32_t streamId,
+    PublicationParams params, uint8_t lane) {
+  auto idler = idle::backoff(timer_);
+  auto pub = co_await addPublication(*aeron_, channel, streamId, params, idler);
+  idler.reset();
+
+  auto ack = awaitAck(pub->sessionId());
+  co_await writeSyn(
+    idler, *pub, channel_, streamId_, params, false, nullptr, lane, blobPrefix_ != nullptr);
+
+  auto acked = co_await ack;
+  auto stream = newMessageStream(
+    timer_, responses_->receiver(), kj::mv(pub), kj::mv(acked.image), options_);
+  KJ_IF_MAYBE(prefix, blobPrefix_) {
+    stream->acceptBlobs(*prefix);
+  }
+  stream->setPeerAcceptsBlobs(acked.blobs);
+  stream->setPeerParams(acked.params);
+  co_return kj::mv(stream);
 }
 
-kj::Promise<kj::Own<AeronMessageStream>> Connector::connect(
+kj::Promise<kj::Own<MultiplexedSession>> Connector::connectShared(
     kj::StringPtr channel, int32_t streamId) {
-  auto idler = kj::attachVal(idle::backoff(timer_));
-  return addPublication(*aeron_, channel, streamId, *idler).attach(kj::mv(idler))
-    .then(
-      [this](auto pub) {
-	auto sessionId = pub->sessionId();
-	auto paf = kj::newPromiseAndFulfiller<::aeron::Image>();
-	fulfillers_.insert(sessionId, kj::mv(paf.fulfiller));
-
-	capnp::MallocMessageBuilder mb{capnp::sizeInWords<aeron::Syn>()};
-	auto syn = mb.initRoot<aeron::Syn>();
-	syn.setChannel(channel_);
-	syn.setStreamId(streamId_);
-	KJ_LOG(INFO, "Connector > SYN", channel_, streamId_);
-	auto idler = kj::attachVal(idle::backoff(timer_));
-	return offerMessage(*pub, mb, *idler).attach(kj::mv(idler))
-	  .then(
-	    [this, pub = kj::mv(pub), promise = kj::mv(paf.promise)]() mutable {
-	      return promise.then(
-		[this, pub = kj::mv(pub)](auto image) {
-		  auto readIdler = kj::attachVal(idle::periodic(timer_, kj::NANOSECONDS));
-		  auto writeIdler = kj::attachVal(idle::backoff(timer_));
-		  return kj::heap<AeronMessageStream>(
-		    *pub, kj::mv(image), *readIdler, *writeIdler
-		  ).attach(kj::mv(pub), kj::mv(readIdler), kj::mv(writeIdler));
-		}
-	      );
-	    }
-	  );
+  auto idler = idle::backoff(timer_);
+  auto pub = co_await addPublication<::aeron::Publication>(
+    *aeron_, channel, streamId, params_, idler);
+  idler.reset();
+
+  auto ack = awaitAck(pub->sessionId());
+  co_await writeSyn(idler, *pub, channel_, streamId_, params_, true);
+
+  auto image = kj::mv((co_await ack).image);
+  auto unavailable = responses_->receiver().onUnavailable(image.sessionId());
+  auto session = kj::heap<MultiplexedSession>(timer_, kj::mv(pub), kj::mv(image), options_);
+  session->disconnectWhen(kj::mv(unavailable));
+  co_return kj::mv(session);
+}
+
+// Buffers messages until the handshake is under way, then forwards to the
+// connected stream.
+struct Connector::EarlyMessageStream final
+  : capnp::MessageStream {
+
+  EarlyMessageStream(Connector& connector, kj::StringPtr channel, int32_t streamId)
+    : connector_{connector}
+    , ready_{connect(kj::str(channel), streamId)
+	.catch_([this](kj::Exception&& exc) {
+	  failed_ = kj::cp(exc);
+	  early_.clear();
+	  while (!late_.empty()) {
+	    late_.pop();
+	  }
+	  kj::throwFatalException(kj::mv(exc));
+	})
+	.fork()} {
+  }
+
+  kj::Promise<kj::Maybe<capnp::MessageReaderAndFds>> tryReadMessage(
+      kj::ArrayPtr<kj::AutoCloseFd> fdSpace,
+      capnp::ReaderOptions options,
+      kj::ArrayPtr<capnp::word> scratchSpace) override {
+    trigger_.fulfiller->fulfill();
+    co_await ready_.addBranch();
+    co_return co_await stream()->tryReadMessage(fdSpace, options, scratchSpace);
+  }
+
+  kj::Promise<void> writeMessage(
+      kj::ArrayPtr<int const> fds,
+      kj::ArrayPtr<kj::ArrayPtr<capnp::word const> const> segments) override {
+    KJ_IF_MAYBE(stream, stream_) {
+      return (*stream)->writeMessage(fds, segments);
+    }
+    KJ_IF_MAYBE(exc, failed_) {
+      return kj::cp(*exc);
+    }
+    trigger_.fulfiller->fulfill();
+    auto words = capnp::messageToFlatArray(segments);
+    if (synSent_) {
+      late_.push(kj::mv(words));
+    }
+    else {
+      early_.add(kj::mv(words));
+    }
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> writeMessages(
+      kj::ArrayPtr<kj::ArrayPtr<kj::ArrayPtr<capnp::word const> const>> messages) override {
+    for (auto msg: messages) {
+      co_await writeMessage(nullptr, msg);
+    }
+  }
+
+  kj::Promise<void> end() override {
+    co_await ready_.addBranch();
+    co_await stream()->end();
+  }
+
+  kj::Maybe<int> getSendBufferSize() override {
+    KJ_IF_MAYBE(stream, stream_) {
+      return (*stream)->getSendBufferSize();
+    }
+    return nullptr;
+  }
+
+private:
+  kj::Promise<void> connect(kj::String channel, int32_t streamId) {
+    auto& connector = connector_;
+    auto idler = idle::backoff(connector.timer_);
+    auto pub = co_await addPublication(
+      *connector.aeron_, channel, streamId, connector.params_, idler);
+    idler.reset();
+
+    // let the rest of the first batch be written
+    co_await kj::mv(trigger_.promise);
+    co_await kj::evalLast([]{});
+
+    // too much to travel with the Syn, so send it afterwards
+    size_t byteSize = 0;
+    for (auto& msg: early_) {
+      byteSize += msg.asBytes().size();
+    }
+    auto messages = kj::mv(early_);
+    if (byteSize > static_cast<size_t>(pub->maxMessageLength() / 2)) {
+      for (auto& msg: messages) {
+	late_.push(kj::mv(msg));
       }
-    );
+      messages.clear();
+    }
+    synSent_ = true;
+
+    auto ack = connector.awaitAck(pub->sessionId());
+    co_await writeSyn(
+      idler, *pub, connector.channel_, connector.streamId_,
+      connector.params_, false, messages.asPtr(), 0, connector.blobPrefix_ != nullptr);
+
+    auto acked = co_await ack;
+    auto stream = newMessageStream(
+      connector.timer_, connector.responses_->receiver(), kj::mv(pub), kj::mv(acked.image),
+      connector.options_);
+    KJ_IF_MAYBE(prefix, connector.blobPrefix_) {
+      stream->acceptBlobs(*prefix);
+    }
+    stream->setPeerAcceptsBlobs(acked.blobs);
+    stream->setPeerParams(acked.params);
+
+    // through the stream, like any other message, and in order with those
+    // written meanwhile
+    while (!late_.empty()) {
+      auto words = late_.pop();
+      capnp::FlatArrayMessageReader reader{words};
+      kj::Vector<kj::ArrayPtr<capnp::word const>> segments;
+      for (auto ii = 0u;; ++ii) {
+	auto segment = reader.getSegment(ii);
+	if (segment == nullptr) {
+	  break;
+	}
+	segments.add(segment);
+      }
+      co_await stream->writeMessage(nullptr, segments);
+    }
+    stream_ = kj::mv(stream);
+  }
+
+  kj::Own<AeronMessageStreamBase>& stream() {
+    return KJ_ASSERT_NONNULL(stream_);
+  }
+
+  Connector& connector_;
+  kj::PromiseFulfillerPair<void> trigger_{kj::newPromiseAndFulfiller<void>()};
+  kj::Vector<kj::Array<capnp::word>> early_;
+  Queue<kj::Array<capnp::word>> late_;
+  bool synSent_{false};
+  kj::Maybe<kj::Own<AeronMessageStreamBase>> stream_;
+  // fails writes that would otherwise queue forever
+  kj::Maybe<kj::Exception> failed_;
+  kj::ForkedPromise<void> ready_;
+};
+
+kj::Own<capnp::MessageStream> Connector::connectEarly(
+    kj::StringPtr channel, int32_t streamId) {
+  return kj::heap<EarlyMessageStream>(*this, channel, streamId);
 }
 
 Listener::Listener(
   kj::Timer& timer,
   std::shared_ptr<::aeron::Aeron> aeron,
   kj::StringPtr channel,
-  int32_t streamId)
+  int32_t streamId,
+  capnp::ReaderOptions options,
+  PublicationParams params)
   : aeron_{kj::mv(aeron)}
   , receiver_{kj::heap<_::ImageReceiver>(*aeron_, channel, streamId)}
-  , timer_{timer} {
+  , timer_{timer}
+  , options_{options}
+  , params_{params} {
 }
 
-kj::Promise<kj::Own<AeronMessageStream>> Listener::accept() {
-  auto idler = kj::attachVal(idle::backoff(timer_));
-  return receiver_->receive(*idler).attach(kj::mv(idler))
-    .then(
-      [this](auto image) mutable {
-	KJ_LOG(INFO, image.sourceIdentity(), image.sessionId());
-	auto idler = kj::attachVal(idle::backoff(timer_));
-	return readMessage(*idler, image).attach(kj::mv(idler))
-	  .then(
-	    [this](auto reader) mutable {
-	      auto syn = reader->template getRoot<aeron::Syn>();
-	      auto channel = syn.getChannel();
-	      auto streamId = syn.getStreamId();
-	      KJ_LOG(INFO, "Listener < SYN", channel, streamId);
-	      auto idler = kj::attachVal(idle::backoff(timer_));
-	      return addPublication(*aeron_, channel, streamId, *idler).attach(kj::mv(idler));
-	    }
-	  )
-	  .then(
-	    [this, image = kj::mv(image)](auto pub) mutable {
-	      auto sessionId = image.sessionId();
-	      KJ_LOG(INFO, "Listener > ACK", sessionId);
-
-	      capnp::MallocMessageBuilder mb{capnp::sizeInWords<aeron::Ack>()};
-	      auto ack = mb.initRoot<aeron::Ack>();
-	      ack.setSessionId(sessionId);
-
-	      auto idler = kj::attachVal(idle::backoff(timer_));
-	      return offerMessage(*pub, mb, *idler).attach(kj::mv(idler))
-		.then(
-		  [this, pub = kj::mv(pub), image = kj::mv(image)]() mutable {
-		    auto readIdler = kj::attachVal(idle::periodic(timer_, kj::NANOSECONDS));
-		    auto writeIdler = kj::attachVal(idle::backoff(timer_));
-		    return kj::heap<AeronMessageStream>(
-		      *pub, kj::mv(image), *readIdler, *writeIdler
-		    ).attach(kj::mv(pub), kj::mv(readIdler), kj::mv(writeIdler));
-		  }
-		);
-	    }
-	  );
-      }
-    );
+Listener::Listener(
+  HandshakeRouter& router,
+  kj::StringPtr channel,
+  int32_t streamId,
+  capnp::ReaderOptions options,
+  PublicationParams params)
+  : aeron_{router.aeron_}
+  , receiver_{kj::Own<_::ImageReceiver>(
+      &router.receiver(channel, streamId), kj::NullDisposer::instance)}
+  , timer_{router.timer_}
+  , options_{options}
+  , params_{params} {
+}
+
+Listener::~Listener() {
+}
+
+void Listener::acceptBlobs(kj::StringPtr poolPrefix) {
+  blobPrefix_ = kj::str(poolPrefix);
+}
+
+kj::Promise<kj::Own<AeronMessageStreamBase>> Listener::accept() {
+  auto idler = idle::backoff(timer_);
+  auto image = co_await receiver_->receive(idler);
+  idler.reset();
+  KJ_LOG(INFO, image.sourceIdentity(), image.sessionId());
+
+  auto reader = co_await readMessage(idler, image);
+  auto syn = reader->getRoot<aeron::Syn>();
+  auto channel = syn.getChannel();
+  auto streamId = syn.getStreamId();
+  auto params = merge(params_, fromCapnp(syn.getParams()));
+  auto multiplexed = syn.getMultiplexed();
+  KJ_LOG(INFO, "Listener < SYN", channel, streamId, multiplexed, syn.getLane(),
+	 syn.getMessages().size());
+
+  auto pub = co_await addPublication(*aeron_, channel, streamId, params, idler);
+  idler.reset();
+
+  // handles are only followed to a peer on this host, and never through
+  // a multiplexed session, whose logical streams don't map blobs
+  kj::Maybe<kj::StringPtr> blobPrefix;
+  KJ_IF_MAYBE(prefix, blobPrefix_) {
+    if (!multiplexed && image.sourceIdentity() == "aeron:ipc") {
+      blobPrefix = *prefix;
+    }
+  }
+
+  auto sessionId = image.sessionId();
+  KJ_LOG(INFO, "Listener > ACK", sessionId, blobPrefix != nullptr);
+  {
+    capnp::MallocMessageBuilder mb{capnp::sizeInWords<aeron::Ack>()};
+    auto ack = mb.initRoot<aeron::Ack>();
+    ack.setSessionId(sessionId);
+    ack.setBlobs(blobPrefix != nullptr);
+    toCapnp(appliedParams(*pub), ack.initParams());
+    co_await writeMessage(idler, *pub, mb.getSegmentsForOutput());
+  }
+
+  auto stream = newMessageStream(timer_, *receiver_, kj::mv(pub), kj::mv(image), options_);
+  stream->setMultiplexed(multiplexed);
+  KJ_IF_MAYBE(prefix, blobPrefix) {
+    stream->acceptBlobs(*prefix);
+  }
+  stream->setPeerAcceptsBlobs(!multiplexed && syn.getBlobs());
+  for (auto msg: syn.getMessages()) {
+    KJ_REQUIRE(msg.size() % sizeof(capnp::word) == 0, "Malformed early message", msg.size());
+    auto words = kj::heapArray<capnp::word>(msg.size() / sizeof(capnp::word));
+    memcpy(words.begin(), msg.begin(), msg.size());
+    stream->pushEarlyMessage(
+      kj::heap<capnp::FlatArrayMessageReader>(words, options_).attach(kj::mv(words)));
+  }
+  co_return kj::mv(stream);
 }
 
 TwoPartyServer::TwoPartyServer(
@@ -313,17 +768,137 @@ TwoPartyServer::TwoPartyServer(
   , tasks_{*this} {
 }
 
+TwoPartyServer::~TwoPartyServer() {
+}
+
 void TwoPartyServer::taskFailed(kj::Exception&& exc) {
   KJ_LOG(ERROR, exc);
 }
 
+// Watches the positions of each connection's publication and image, and
+// closes connections where neither has moved for the timeout.
+struct TwoPartyServer::IdleReaper {
+
+  struct Connection {
+    Connection(IdleReaper& reaper, AeronMessageStreamBase& stream,
+	       kj::Own<kj::PromiseFulfiller<void>> reap)
+      : reaper_{reaper}
+      , stream_{stream}
+      , reap_{kj::mv(reap)}
+      , lastActive_{reaper.timer_.now()} {
+      reaper_.connections_.add(*this);
+    }
+
+    ~Connection() {
+      if (link_.isLinked()) {
+	reaper_.connections_.remove(*this);
+      }
+    }
+
+    IdleReaper& reaper_;
+    AeronMessageStreamBase& stream_;
+    kj::Own<kj::PromiseFulfiller<void>> reap_;
+    int64_t pubPosition_{0};
+    int64_t imagePosition_{0};
+    kj::TimePoint lastActive_;
+    kj::ListLink<Connection> link_;
+  };
+
+  IdleReaper(kj::Timer& timer, kj::Duration timeout)
+    : timer_{timer}
+    , timeout_{timeout}
+    , task_{run().eagerlyEvaluate([](kj::Exception&& exc) {
+	KJ_LOG(ERROR, "Idle reaper failed", exc);
+      })} {
+  }
+
+  ~IdleReaper() {
+    // e.g. a connection accepted by reference, and kept beyond the server
+    while (!connections_.empty()) {
+      connections_.remove(connections_.front());
+    }
+  }
+
+  kj::Promise<void> run() {
+    while (true) {
+      co_await timer_.afterDelay(timeout_ / 4);
+      auto now = timer_.now();
+      for (auto& connection: connections_) {
+	check(connection, now);
+      }
+    }
+  }
+
+  void check(Connection& connection, kj::TimePoint now) {
+    if (!connection.reap_->isWaiting()) {
+      return;
+    }
+    auto& pub = connection.stream_.getPublication();
+    auto& image = connection.stream_.getImage();
+    if (pub.isClosed() || image.isClosed()) {
+      return;
+    }
+
+    auto pubPosition = pub.position();
+    auto imagePosition = image.position();
+    if (pubPosition != connection.pubPosition_ ||
+	imagePosition != connection.imagePosition_) {
+      connection.pubPosition_ = pubPosition;
+      connection.imagePosition_ = imagePosition;
+      connection.lastActive_ = now;
+      return;
+    }
+    if (now - connection.lastActive_ < timeout_) {
+      return;
+    }
+
+    KJ_LOG(INFO, "Reaping idle connection", image.sessionId(), image.sourceIdentity());
+    using ::aeron::concurrent::logbuffer::LogBufferDescriptor::PARTITION_COUNT;
+    ++stats_.reaped;
+    stats_.bytesReclaimed += int64_t{pub.termBufferLength()} * PARTITION_COUNT;
+    // closed here as well, for connections the server doesn't own
+    pub.close();
+    image.close();
+    connection.reap_->fulfill();
+  }
+
+  kj::Timer& timer_;
+  kj::Duration timeout_;
+  IdleStats stats_;
+  kj::List<Connection, &Connection::link_> connections_;
+  kj::Promise<void> task_;
+};
+
+void TwoPartyServer::reapIdle(kj::Timer& timer, kj::Duration timeout) {
+  KJ_REQUIRE(reaper_ == nullptr, "Already reaping idle connections");
+  reaper_ = kj::heap<IdleReaper>(timer, timeout);
+}
+
+TwoPartyServer::IdleStats TwoPartyServer::getIdleStats() const {
+  KJ_IF_MAYBE(reaper, reaper_) {
+    return (*reaper)->stats_;
+  }
+  return {};
+}
+
+kj::Promise<void> TwoPartyServer::reapable(
+    AeronMessageStreamBase& stream, kj::Promise<void> connection) {
+  KJ_IF_MAYBE(reaper, reaper_) {
+    auto paf = kj::newPromiseAndFulfiller<void>();
+    auto tracked = kj::heap<IdleReaper::Connection>(**reaper, stream, kj::mv(paf.fulfiller));
+    return connection.exclusiveJoin(kj::mv(paf.promise)).attach(kj::mv(tracked));
+  }
+  return connection;
+}
+
 struct TwoPartyServer::AcceptedConnection {
 
   explicit AcceptedConnection(
     capnp::Capability::Client bootstrapInterface,
-    kj::Own<capnp::MessageStream> connection)
+    kj::Own<capnp::MessageStream> connection,
+    capnp::ReaderOptions options)
     : connection_{kj::mv(connection)}
-    , network_{*connection_, capnp::rpc::twoparty::Side::SERVER}
+    , network_{*connection_, capnp::rpc::twoparty::Side::SERVER, options}
     , rpcSystem_{capnp::makeRpcServer(network_, kj::mv(bootstrapInterface))} {
   }
 
@@ -332,30 +907,118 @@ struct TwoPartyServer::AcceptedConnection {
   capnp::RpcSystem<capnp::rpc::twoparty::VatId> rpcSystem_;
 };
 
-kj::Promise<void> TwoPartyServer::accept(AeronMessageStream& connection) {
+void TwoPartyServer::trace(AeronMessageStreamBase& connection) {
+  if (!tracing_ || connection.isMultiplexed()) {
+    return;
+  }
+  auto& trace = connection.enableTracing();
+  traces_.upsert(
+    connection.getImage().sessionId(), kj::addRef(trace),
+    [](auto& existing, auto&& replacement) {
+      existing = kj::mv(replacement);
+    });
+}
+
+Instrumentation& TwoPartyServer::enableInstrumentation() {
+  if (instrumentation_ == nullptr) {
+    auto instrumentation = kj::refcounted<Instrumentation>();
+    bootstrapInterface_ = instrumentation->wrap(kj::mv(bootstrapInterface_));
+    instrumentation_ = kj::mv(instrumentation);
+  }
+  return KJ_ASSERT_NONNULL(getInstrumentation());
+}
+
+kj::Maybe<Instrumentation&> TwoPartyServer::getInstrumentation() {
+  KJ_IF_MAYBE(instrumentation, instrumentation_) {
+    return **instrumentation;
+  }
+  return nullptr;
+}
+
+ResponseCache& TwoPartyServer::enableCache(
+    kj::Timer& timer, capnp::InterfaceSchema schema, size_t maxBytes) {
+  if (cache_ == nullptr) {
+    auto cache = kj::refcounted<ResponseCache>(timer, maxBytes);
+    bootstrapInterface_ = cache->wrap(kj::mv(bootstrapInterface_), schema);
+    cache_ = kj::mv(cache);
+  }
+  return KJ_ASSERT_NONNULL(getCache());
+}
+
+kj::Maybe<ResponseCache&> TwoPartyServer::getCache() {
+  KJ_IF_MAYBE(cache, cache_) {
+    return **cache;
+  }
+  return nullptr;
+}
+
+kj::Promise<void> TwoPartyServer::accept(AeronMessageStreamBase& connection) {
+  trace(connection);
+  auto options = connection.getReaderOptions();
   auto stream = kj::Own<capnp::MessageStream>(&connection, kj::NullDisposer::instance);
-  auto connectionState = kj::heap<AcceptedConnection>(bootstrapInterface_, kj::mv(stream));
-  return connectionState->network_.onDisconnect().attach(kj::mv(connectionState));
+  auto connectionState = kj::heap<AcceptedConnection>(
+      bootstrapInterface_, kj::mv(stream), options);
+  return reapable(
+    connection, connectionState->network_.onDisconnect().attach(kj::mv(connectionState)));
+}
+
+// Shared by the connections accepted over a multiplexed session, which
+// must not outlive it.
+struct TwoPartyServer::MultiplexedConnection
+  : kj::Refcounted {
+
+  kj::Maybe<kj::Own<MultiplexedSession>> session_;
+};
+
+void TwoPartyServer::accept(kj::Own<AeronMessageStreamBase> connection, kj::Timer& timer) {
+  auto options = connection->getReaderOptions();
+  auto& base = *connection;
+  if (connection->isMultiplexed()) {
+    auto state = kj::refcounted<MultiplexedConnection>();
+    auto session = kj::heap<MultiplexedSession>(
+      timer, kj::mv(connection),
+      [this, options, &shared = *state](kj::Own<capnp::MessageStream> stream) {
+	auto connectionState = kj::heap<AcceptedConnection>(
+	    bootstrapInterface_, kj::mv(stream), options);
+	tasks_.add(
+	  connectionState->network_.onDisconnect()
+	    .attach(kj::mv(connectionState))
+	    .attach(kj::addRef(shared)));
+      });
+    auto disconnected = session->onDisconnect();
+    state->session_ = kj::mv(session);
+    tasks_.add(reapable(base, disconnected.attach(kj::mv(state))));
+    return;
+  }
+
+  trace(*connection);
+  auto connectionState = kj::heap<AcceptedConnection>(
+      bootstrapInterface_, kj::mv(connection), options);
+  tasks_.add(reapable(
+    base, connectionState->network_.onDisconnect().attach(kj::mv(connectionState))));
 }
 
-void TwoPartyServer::accept(kj::Own<AeronMessageStream> connection) {
+void TwoPartyServer::accept(
+    kj::Own<capnp::MessageStream> connection, capnp::ReaderOptions options) {
   auto connectionState = kj::heap<AcceptedConnection>(
-      bootstrapInterface_, kj::mv(connection));
+      bootstrapInterface_, kj::mv(connection), options);
   tasks_.add(connectionState->network_.onDisconnect().attach(kj::mv(connectionState)));
 }
 
 kj::Promise<void> TwoPartyServer::listen(Listener& listener) {
-  return listener.accept()
-    .then(
-      [this, &listener](auto connection) mutable {
-	accept(kj::mv(connection));
-	return listen(listener);
-      }
-    );
+  while (true) {
+    accept(co_await listener.accept(), listener.timer_);
+  }
+}
+
+TwoPartyClient::TwoPartyClient(AeronMessageStreamBase& connection)
+  : network_{connection, capnp::rpc::twoparty::Side::CLIENT, connection.getReaderOptions()}
+  , rpcSystem_{capnp::makeRpcClient(network_)} {
 }
 
-TwoPartyClient::TwoPartyClient(AeronMessageStream& connection)
-  : network_{connection, capnp::rpc::twoparty::Side::CLIENT}
+TwoPartyClient::TwoPartyClient(
+  capnp::MessageStream& connection, capnp::ReaderOptions options)
+  : network_{connection, capnp::rpc::twoparty::Side::CLIENT, options}
   , rpcSystem_{capnp::makeRpcClient(network_)} {
 }
 
@@ -6,6 +6,9 @@
 // RPC connectivity using Capnproto messages to perform the initial handshaking.
 // See https://aeron.io/docs/step-by-step-rpc-server/requirements-overview/
 
+#include "cache.h"
+#include "instrument.h"
+#include "mux.h"
 #include "serialize.h"
 
 #include <capnp/capability.h>
@@ -22,35 +25,99 @@ namespace aeroncap {
 namespace _ {
 struct ImageReceiver;
 KJ_DECLARE_NON_POLYMORPHIC(ImageReceiver);
+struct ResponseRouter;
+KJ_DECLARE_NON_POLYMORPHIC(ResponseRouter);
+struct AckedImage;
 }
 
-struct Connector
-  : private kj::TaskSet::ErrorHandler {
+// Shares the handshake subscriptions of the Connectors and Listeners of an
+// event loop, so that however many there are, each channel and stream id
+// costs one subscription, and for Connectors one polling loop, rather than
+// one each. Acks are dispatched to the Connector awaiting them by session
+// id, so many Connectors can share a response channel. The router must
+// outlive the Connectors and Listeners constructed with it.
+struct HandshakeRouter {
+
+  HandshakeRouter(kj::Timer&, std::shared_ptr<::aeron::Aeron>);
+  ~HandshakeRouter();
+
+private:
+  friend struct Connector;
+  friend struct Listener;
+
+  _::ResponseRouter& responses(kj::StringPtr channel, int32_t streamId);
+  _::ImageReceiver& receiver(kj::StringPtr channel, int32_t streamId);
+
+  kj::Timer& timer_;
+  std::shared_ptr<::aeron::Aeron> aeron_;
+  kj::HashMap<kj::String, kj::Own<_::ResponseRouter>> responses_;
+  kj::HashMap<kj::String, kj::Own<_::ImageReceiver>> receivers_;
+};
+
+struct Connector {
 
   Connector(
     kj::Timer&,
     std::shared_ptr<::aeron::Aeron>,
     kj::StringPtr channel,
-    int32_t streamId);
+    int32_t streamId,
+    capnp::ReaderOptions = {},
+    PublicationParams = {});
+
+  // Awaits Acks on the router's shared subscription of the channel.
+  Connector(
+    HandshakeRouter&,
+    kj::StringPtr channel,
+    int32_t streamId,
+    capnp::ReaderOptions = {},
+    PublicationParams = {});
 
   ~Connector();
 
-  kj::Promise<kj::Own<AeronMessageStream>> connect(
+  kj::Promise<kj::Own<AeronMessageStreamBase>> connect(
+      kj::StringPtr channel, int32_t streamId);
+
+  // Connects over a concurrent publication, so that any number of threads
+  // can open logical streams on the returned session.
+  kj::Promise<kj::Own<MultiplexedSession>> connectShared(
       kj::StringPtr channel, int32_t streamId);
 
+  // Connects without waiting for the handshake. Whatever is written to the
+  // returned stream in the same turn of the event loop as its first
+  // message travels with the Syn, so that the first calls arrive a round
+  // trip sooner. The stream must not outlive the Connector.
+  kj::Own<capnp::MessageStream> connectEarly(
+      kj::StringPtr channel, int32_t streamId);
+
+  // Connects a session per lane, each with its own publication parameters,
+  // so that bulk transfers on one lane never hold up calls on another. See
+  // `LanedClient`.
+  kj::Promise<kj::Array<kj::Own<AeronMessageStreamBase>>> connectLanes(
+      kj::StringPtr channel, int32_t streamId,
+      kj::ArrayPtr<PublicationParams const> lanes);
+
+  // Has the streams connected from now on read blob handles to pools whose
+  // names start with `poolPrefix`, and tells the Listener so, see
+  // `BlobPool`. The response channel must be on aeron:ipc.
+  void acceptBlobs(kj::StringPtr poolPrefix);
+
 private:
-  void taskFailed(kj::Exception&&) override;
-  kj::Promise<void> handleResponses();
+  struct EarlyMessageStream;
+
+  kj::Promise<_::AckedImage> awaitAck(int32_t sessionId);
+  kj::Promise<kj::Own<AeronMessageStreamBase>> connectLane(
+      kj::StringPtr channel, int32_t streamId,
+      PublicationParams params, uint8_t lane);
 
   std::shared_ptr<::aeron::Aeron> aeron_;
-  kj::Own<_::ImageReceiver> receiver_;
+  kj::Own<_::ResponseRouter> responses_;
   kj::Timer& timer_;
   kj::Canceler canceler_;
-  kj::TaskSet tasks_;
   kj::String channel_;
   int32_t streamId_;
-
-  kj::HashMap<int32_t, kj::Own<kj::PromiseFulfiller<::aeron::Image>>> fulfillers_;
+  capnp::ReaderOptions options_;
+  PublicationParams params_;
+  kj::Maybe<kj::String> blobPrefix_;
 };
 
 struct Listener {
@@ -59,38 +126,117 @@ struct Listener {
     kj::Timer&,
     std::shared_ptr<::aeron::Aeron>,
     kj::StringPtr channel,
-    int32_t streamId);
+    int32_t streamId,
+    capnp::ReaderOptions = {},
+    PublicationParams = {});
 
-  kj::Promise<kj::Own<AeronMessageStream>> accept();
+  // Accepts from the router's shared subscription of the channel, along
+  // with any other Listeners on it.
+  Listener(
+    HandshakeRouter&,
+    kj::StringPtr channel,
+    int32_t streamId,
+    capnp::ReaderOptions = {},
+    PublicationParams = {});
+
+  ~Listener();
+
+  kj::Promise<kj::Own<AeronMessageStreamBase>> accept();
+
+  // Has the streams accepted from now on read blob handles to pools whose
+  // names start with `poolPrefix`, though only from Connectors on
+  // aeron:ipc, and never on multiplexed sessions. See `BlobPool`.
+  void acceptBlobs(kj::StringPtr poolPrefix);
 
   std::shared_ptr<::aeron::Aeron> aeron_;
   kj::Own<_::ImageReceiver> receiver_;
   kj::Timer& timer_;
+  capnp::ReaderOptions options_;
+  PublicationParams params_;
+  kj::Maybe<kj::String> blobPrefix_;
 };
 
 struct TwoPartyServer
   : private kj::TaskSet::ErrorHandler {
 
   explicit TwoPartyServer(capnp::Capability::Client bootstrapInterface);
+  ~TwoPartyServer();
 
-  kj::Promise<void> accept(AeronMessageStream&);
-  void accept(kj::Own<AeronMessageStream>);
+  kj::Promise<void> accept(AeronMessageStreamBase&);
+  // The timer paces the writes of the logical streams of a multiplexed
+  // connection.
+  void accept(kj::Own<AeronMessageStreamBase>, kj::Timer&);
+  void accept(kj::Own<capnp::MessageStream>, capnp::ReaderOptions = {});
 
   kj::Promise<void> listen(Listener& listener);
   kj::Promise<void> drain() { return tasks_.onEmpty(); }
 
+  // Traces each connection accepted from now on, see `StreamTrace`. The
+  // traces are kept, by the session id of the client's publication, until
+  // cleared. For the client's side of a connection, enable tracing on its
+  // stream too, so that both directions are stamped. Multiplexed sessions
+  // are never traced, as their frames' reserved values carry the ids of
+  // their logical streams instead.
+  void enableTracing() { tracing_ = true; }
+  kj::HashMap<int32_t, kj::Own<StreamTrace>> const& getTraces() const { return traces_; }
+  void clearTraces() { traces_.clear(); }
+
+  // Records the calls made on the bootstrap capability, and on those its
+  // calls return, by method, see `Instrumentation`. Only connections
+  // accepted from now on are instrumented.
+  Instrumentation& enableInstrumentation();
+  kj::Maybe<Instrumentation&> getInstrumentation();
+
+  // Answers repeated calls to the `$cacheable` methods of the bootstrap
+  // interface from a cache shared by every connection accepted from now
+  // on, see `ResponseCache`.
+  template <typename T>
+  ResponseCache& enableCache(kj::Timer& timer, size_t maxBytes = 64u << 20) {
+    return enableCache(timer, capnp::Schema::from<T>(), maxBytes);
+  }
+  ResponseCache& enableCache(kj::Timer&, capnp::InterfaceSchema, size_t maxBytes = 64u << 20);
+  kj::Maybe<ResponseCache&> getCache();
+
+  struct IdleStats {
+    uint64_t reaped{0};
+    // log buffer bytes of the publications closed. Not those of their
+    // images, which stay mapped until the client closes its side too.
+    uint64_t bytesReclaimed{0};
+  };
+
+  // Closes connections over which nothing has been sent or received for
+  // `timeout`, to free their log buffers. The client sees its connection
+  // disconnect, and must connect afresh should it come back, as a
+  // `ConnectionPool` does by itself. A call outlasting the timeout with
+  // nothing else on its connection is cut off too. Only Aeron connections
+  // accepted from now on are reaped.
+  void reapIdle(kj::Timer&, kj::Duration timeout);
+  IdleStats getIdleStats() const;
+
 private:
   void taskFailed(kj::Exception&&) override;
+  void trace(AeronMessageStreamBase&);
+  kj::Promise<void> reapable(AeronMessageStreamBase&, kj::Promise<void> connection);
 
   capnp::Capability::Client bootstrapInterface_;
   kj::TaskSet tasks_;
+  bool tracing_{false};
+  kj::HashMap<int32_t, kj::Own<StreamTrace>> traces_;
+  kj::Maybe<kj::Own<Instrumentation>> instrumentation_;
+  kj::Maybe<kj::Own<ResponseCache>> cache_;
+
+  struct IdleReaper;
+  kj::Maybe<kj::Own<IdleReaper>> reaper_;
 
   struct AcceptedConnection;
+  struct MultiplexedConnection;
 };
 
 struct TwoPartyClient {
-  explicit TwoPartyClient(AeronMessageStream&);
+  explicit TwoPartyClient(AeronMessageStreamBase&);
+  TwoPartyClient(capnp::MessageStream&, capnp::ReaderOptions = {});
   capnp::Capability::Client bootstrap();
+  kj::Promise<void> onDisconnect() { return network_.onDisconnect(); }
 
 private:
   capnp::TwoPartyVatNetwork network_;
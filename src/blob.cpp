@@ -0,0 +1,275 @@
+// Copyright (c) 2023 Vaci Koblizek.
+// Licensed under the Apache 2.0 license found in the LICENSE file or at:
+//     https://opensource.org/licenses/Apache-2.0
+
+#include "blob.h"
+
+#include "aeron-rpc.capnp.h"
+
+#include <capnp/serialize.h>
+#include <kj/debug.h>
+#include <kj/io.h>
+
+#include <atomic>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace aeroncap {
+
+namespace {
+
+constexpr uint64_t MAGIC = 0x73626f6c62706163ull;
+
+// The segment count, less one, of a handle frame. capnp limits a message
+// to far fewer segments, so it can't be mistaken for one.
+constexpr uint32_t HANDLE_MARKER = 0xffffffff;
+
+constexpr size_t PAGE_SIZE = 4096;
+
+size_t roundUp(size_t size, size_t to) {
+  return (size + to - 1) / to * to;
+}
+
+}
+
+// Both at the start of the mapping, where every process can see them.
+struct BlobPool::Header {
+  uint64_t magic;
+  uint32_t slotCount;
+  uint32_t reserved;
+  uint64_t slotSize;
+};
+
+struct BlobPool::Slot {
+  // 1 from the placement until the reader is destroyed, 0 when free
+  std::atomic<uint32_t> refs;
+  // bumped on every placement, so that a stale handle is caught
+  std::atomic<uint32_t> generation;
+};
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free);
+
+namespace {
+
+size_t dataOffset(uint32_t slotCount) {
+  return roundUp(sizeof(BlobPool::Header) + slotCount * sizeof(BlobPool::Slot), PAGE_SIZE);
+}
+
+void* map(int fd, size_t size) {
+  auto mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (mapping == MAP_FAILED) {
+    KJ_FAIL_SYSCALL("mmap", errno);
+  }
+  return mapping;
+}
+
+}
+
+kj::Own<BlobPool> BlobPool::create(
+    kj::StringPtr name, uint32_t slotCount, size_t slotSize) {
+  KJ_REQUIRE(slotCount > 0);
+  slotSize = roundUp(slotSize, PAGE_SIZE);
+  auto mappingSize = dataOffset(slotCount) + slotCount * slotSize;
+
+  // fail, rather than unlink, a name in use, as its pool may be live
+  int fd;
+  KJ_SYSCALL(fd = shm_open(name.cStr(), O_CREAT | O_EXCL | O_RDWR, 0600), name);
+  kj::AutoCloseFd ownFd{fd};
+  // sparse, so pages are only backed once written
+  KJ_SYSCALL(ftruncate(fd, mappingSize), name);
+
+  auto mapping = map(fd, mappingSize);
+  auto& header = *static_cast<Header*>(mapping);
+  header.slotCount = slotCount;
+  header.slotSize = slotSize;
+  std::atomic_ref{header.magic}.store(MAGIC, std::memory_order_release);
+
+  auto pool = kj::refcounted<BlobPool>(kj::str(name), mapping, mappingSize, true);
+  pool->slotCount_ = slotCount;
+  pool->slotSize_ = slotSize;
+  return pool;
+}
+
+kj::Own<BlobPool> BlobPool::open(kj::StringPtr name) {
+  int fd;
+  KJ_SYSCALL(fd = shm_open(name.cStr(), O_RDWR, 0), name);
+  kj::AutoCloseFd ownFd{fd};
+
+  struct stat stats;
+  KJ_SYSCALL(fstat(fd, &stats), name);
+  size_t mappingSize = stats.st_size;
+  KJ_REQUIRE(mappingSize >= sizeof(Header), "Not a blob pool", name);
+
+  auto mapping = map(fd, mappingSize);
+  auto pool = kj::refcounted<BlobPool>(kj::str(name), mapping, mappingSize, false);
+
+  auto& header = *static_cast<Header*>(mapping);
+  KJ_REQUIRE(std::atomic_ref{header.magic}.load(std::memory_order_acquire) == MAGIC,
+	     "Not a blob pool", name);
+
+  // the header is the peer's to write, so check the pool's own copies of
+  // it, and without overflowing
+  pool->slotCount_ = header.slotCount;
+  pool->slotSize_ = header.slotSize;
+  auto slotCount = pool->slotCount_;
+  KJ_REQUIRE(slotCount > 0 && dataOffset(slotCount) <= mappingSize &&
+	     pool->slotSize_ <= (mappingSize - dataOffset(slotCount)) / slotCount,
+	     "Blob pool is truncated", name);
+  return pool;
+}
+
+BlobPool::BlobPool(kj::String name, void* mapping, size_t mappingSize, bool owner)
+  : name_{kj::mv(name)}
+  , mapping_{mapping}
+  , mappingSize_{mappingSize}
+  , owner_{owner} {
+}
+
+BlobPool::~BlobPool() noexcept {
+  munmap(mapping_, mappingSize_);
+  if (owner_) {
+    shm_unlink(name_.cStr());
+  }
+}
+
+uint32_t BlobPool::getSlotCount() const {
+  return slotCount_;
+}
+
+size_t BlobPool::getSlotSize() const {
+  return slotSize_;
+}
+
+uint32_t BlobPool::inUse() const {
+  uint32_t count = 0;
+  for (auto ii = 0u; ii < getSlotCount(); ++ii) {
+    if (slot(ii).refs.load(std::memory_order_relaxed)) {
+      ++count;
+    }
+  }
+  return count;
+}
+
+BlobPool::Slot& BlobPool::slot(uint32_t index) const {
+  auto slots = reinterpret_cast<Slot*>(static_cast<Header*>(mapping_) + 1);
+  return slots[index];
+}
+
+capnp::word* BlobPool::slotData(uint32_t index) const {
+  auto data = static_cast<capnp::byte*>(mapping_) + dataOffset(getSlotCount());
+  return reinterpret_cast<capnp::word*>(data + index * getSlotSize());
+}
+
+kj::Maybe<kj::Own<BlobPool::Placement>> BlobPool::tryPlace(
+    kj::ArrayPtr<kj::ArrayPtr<capnp::word const> const> segments) {
+
+  auto wordSize = capnp::computeSerializedSizeInWords(segments);
+  if (wordSize > getSlotSize() / sizeof(capnp::word)) {
+    return nullptr;
+  }
+
+  // in turn, rather than contending for the first slots every time
+  auto slotCount = getSlotCount();
+  for (auto ii = 0u; ii < slotCount; ++ii) {
+    auto index = next_++ % slotCount;
+    auto& s = slot(index);
+    uint32_t free = 0;
+    if (!s.refs.compare_exchange_strong(free, 1, std::memory_order_acquire)) {
+      continue;
+    }
+    auto generation = s.generation.fetch_add(1, std::memory_order_relaxed) + 1;
+
+    kj::ArrayOutputStream output{
+      kj::arrayPtr(reinterpret_cast<capnp::byte*>(slotData(index)), getSlotSize())};
+    capnp::writeMessage(output, segments);
+
+    capnp::MallocMessageBuilder mb{capnp::sizeInWords<aeron::BlobHandle>() + 8};
+    auto handle = mb.initRoot<aeron::BlobHandle>();
+    handle.setPool(name_);
+    handle.setSlot(index);
+    handle.setGeneration(generation);
+    handle.setSize(wordSize);
+    auto words = capnp::messageToFlatArray(mb);
+
+    auto frame = kj::heapArray<capnp::word>(words.size() + 1);
+    uint64_t marker = HANDLE_MARKER;
+    memcpy(frame.begin(), &marker, sizeof(marker));
+    memcpy(frame.begin() + 1, words.begin(), words.asBytes().size());
+    return kj::heap<Placement>(kj::addRef(*this), index, kj::mv(frame));
+  }
+  return nullptr;
+}
+
+kj::Own<capnp::MessageReader> BlobPool::read(
+    uint32_t index, uint32_t generation, uint64_t wordSize, capnp::ReaderOptions options) {
+
+  KJ_REQUIRE(index < getSlotCount(), "Blob handle out of range", name_, index);
+  KJ_REQUIRE(wordSize <= getSlotSize() / sizeof(capnp::word), "Blob handle too large", name_, index);
+  auto& s = slot(index);
+  KJ_REQUIRE(s.refs.load(std::memory_order_acquire) &&
+	     s.generation.load(std::memory_order_relaxed) == generation,
+	     "Stale blob handle", name_, index);
+
+  auto words = kj::arrayPtr<capnp::word const>(slotData(index), wordSize);
+  return kj::heap<capnp::FlatArrayMessageReader>(words, options)
+    .attach(kj::defer([pool = kj::addRef(*this), index]() {
+      pool->release(index);
+    }));
+}
+
+void BlobPool::release(uint32_t index) {
+  slot(index).refs.store(0, std::memory_order_release);
+}
+
+BlobPool::Placement::Placement(
+  kj::Own<BlobPool> pool, uint32_t slot, kj::Array<capnp::word> frame)
+  : pool_{kj::mv(pool)}
+  , slot_{slot}
+  , frame_{kj::mv(frame)} {
+}
+
+BlobPool::Placement::~Placement() noexcept {
+  if (!sent_) {
+    pool_->release(slot_);
+  }
+}
+
+BlobMapper::BlobMapper(kj::StringPtr poolPrefix)
+  : poolPrefix_{kj::str(poolPrefix)} {
+  KJ_REQUIRE(poolPrefix_.startsWith("/") && poolPrefix_.size() > 1,
+	     "Blob pool prefix must name shared memory", poolPrefix_);
+}
+
+bool BlobMapper::isHandle(uint8_t const* bytes, size_t length) {
+  uint32_t segmentCount;
+  if (length < sizeof(capnp::word)) {
+    return false;
+  }
+  memcpy(&segmentCount, bytes, sizeof(segmentCount));
+  return segmentCount == HANDLE_MARKER;
+}
+
+kj::Own<capnp::MessageReader> BlobMapper::read(
+    uint8_t const* bytes, size_t length, capnp::ReaderOptions options) {
+
+  // copied out, rather than relying on where the frame lies in the term
+  auto wordSize = length / sizeof(capnp::word) - 1;
+  auto words = kj::heapArray<capnp::word>(wordSize);
+  memcpy(words.begin(), bytes + sizeof(capnp::word), words.asBytes().size());
+
+  capnp::FlatArrayMessageReader reader{words};
+  auto handle = reader.getRoot<aeron::BlobHandle>();
+  auto name = handle.getPool();
+  KJ_REQUIRE(name.startsWith(poolPrefix_) &&
+	     name.slice(1).findFirst('/') == nullptr,
+	     "Blob handle names a pool not accepted", name, poolPrefix_);
+
+  auto& pool = pools_.findOrCreate(name, [name]() {
+    return decltype(pools_)::Entry{kj::str(name), BlobPool::open(name)};
+  });
+  return pool->read(handle.getSlot(), handle.getGeneration(), handle.getSize(), options);
+}
+
+}
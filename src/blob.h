@@ -0,0 +1,116 @@
+#pragma once
+// Copyright (c) 2023 Vaci Koblizek.
+// Licensed under the Apache 2.0 license found in the LICENSE file or at:
+//     https://opensource.org/licenses/Apache-2.0
+
+// A shared memory side channel for large messages between processes on
+// the same host. A stream with blobs enabled places each message above a
+// threshold in a slot of its `BlobPool`, a memory-mapped file under
+// /dev/shm, and publishes only a small `BlobHandle` frame in its place.
+// The reader maps the writer's pool in, reads the message where it lies,
+// and returns the slot to the pool once the reader is destroyed.
+//
+// A handle frame is marked by a segment count that no capnp message can
+// have. A reader follows handles only once it has agreed to, and only to
+// pools named with a prefix of its choosing, lest a peer have it map and
+// write to whatever shared memory it names; anywhere else a handle fails
+// the stream. A slot whose handle is never read, e.g. as the peer went
+// away first, stays taken for the life of the pool.
+
+#include <capnp/message.h>
+#include <kj/map.h>
+#include <kj/refcount.h>
+#include <kj/string.h>
+
+namespace aeroncap {
+
+struct BlobPool
+  : kj::Refcounted {
+
+  // Creates a pool of `slotCount` slots, each holding a message of up to
+  // `slotSize` bytes, under `name` in the shared memory namespace, e.g.
+  // "/aeron-blobs-1234". Fails if the name is already taken, whether by a
+  // live pool or one left behind by a process that crashed, so include
+  // e.g. the process id. The name is unlinked when the pool is destroyed.
+  static kj::Own<BlobPool> create(kj::StringPtr name, uint32_t slotCount, size_t slotSize);
+
+  // Maps in a pool created by another process.
+  static kj::Own<BlobPool> open(kj::StringPtr name);
+
+  ~BlobPool() noexcept;
+
+  kj::StringPtr getName() const { return name_; }
+  uint32_t getSlotCount() const;
+  size_t getSlotSize() const;
+
+  // The number of slots taken, whether by a message still to be read or
+  // by a reader still alive.
+  uint32_t inUse() const;
+
+  // A message placed in a slot, along with the handle frame to publish in
+  // its stead. The slot is released if the placement is destroyed before
+  // the frame is sent.
+  struct Placement {
+    Placement(kj::Own<BlobPool>, uint32_t slot, kj::Array<capnp::word> frame);
+    ~Placement() noexcept;
+    KJ_DISALLOW_COPY_AND_MOVE(Placement);
+
+    kj::ArrayPtr<capnp::byte> getFrame() { return frame_.asBytes(); }
+
+    // The frame is published, and the reader now holds the slot.
+    void sent() { sent_ = true; }
+
+  private:
+    kj::Own<BlobPool> pool_;
+    uint32_t slot_;
+    kj::Array<capnp::word> frame_;
+    bool sent_{false};
+  };
+
+  // Copies a message into a free slot. Null if the message is too large
+  // for a slot, or every slot is taken, in which case the caller should
+  // publish the message as usual.
+  kj::Maybe<kj::Own<Placement>> tryPlace(
+    kj::ArrayPtr<kj::ArrayPtr<capnp::word const> const> segments);
+
+  // Reads the message in a slot, in place.
+  kj::Own<capnp::MessageReader> read(
+    uint32_t slot, uint32_t generation, uint64_t wordSize, capnp::ReaderOptions);
+
+  struct Header;
+  struct Slot;
+
+  BlobPool(kj::String name, void* mapping, size_t mappingSize, bool owner);
+
+private:
+  void release(uint32_t slot);
+  Slot& slot(uint32_t index) const;
+  capnp::word* slotData(uint32_t index) const;
+
+  kj::String name_;
+  void* mapping_;
+  size_t mappingSize_;
+  bool owner_;
+  // as found in the header on creation or opening, lest a peer change them
+  uint32_t slotCount_{0};
+  size_t slotSize_{0};
+  uint32_t next_{0};
+};
+
+// Reads handle frames, mapping in the pools they name as they arrive, as
+// long as their names start with `poolPrefix`, e.g. "/aeron-blobs-".
+struct BlobMapper {
+
+  explicit BlobMapper(kj::StringPtr poolPrefix);
+
+  static bool isHandle(uint8_t const* bytes, size_t length);
+
+  kj::Own<capnp::MessageReader> read(
+    uint8_t const* bytes, size_t length, capnp::ReaderOptions);
+
+private:
+  kj::String poolPrefix_;
+  kj::HashMap<kj::String, kj::Own<BlobPool>> pools_;
+};
+
+}
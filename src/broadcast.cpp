@@ -0,0 +1,152 @@
+// Copyright (c) 2023 Vaci Koblizek.
+// Licensed under the Apache 2.0 license found in the LICENSE file or at:
+//     https://opensource.org/licenses/Apache-2.0
+
+#include "broadcast.h"
+#include "aeron-rpc.capnp.h"
+
+#include <capnp/serialize.h>
+
+namespace aeroncap {
+
+namespace {
+
+// As `_::writeMessage`, but resolves to the position of the stream just
+// after the message, which later writes may have moved on by then.
+kj::Promise<int64_t> publish(
+    Idler& idler,
+    ::aeron::ExclusivePublication& pub,
+    kj::ArrayPtr<kj::ArrayPtr<capnp::word const> const> segments) {
+
+  auto byteSize = capnp::computeSerializedSizeInWords(segments) * sizeof(capnp::word);
+  int64_t position;
+  if (byteSize <= pub.maxPayloadLength()) {
+    if ((position = _::tryClaim(pub, segments, byteSize))) {
+      co_return position;
+    }
+    do {
+      co_await idler.idle();
+    } while (!(position = _::tryClaim(pub, segments, byteSize)));
+  }
+  else {
+    auto words = capnp::messageToFlatArray(segments);
+    if ((position = _::tryOffer(pub, words.asBytes()))) {
+      co_return position;
+    }
+    do {
+      co_await idler.idle();
+    } while (!(position = _::tryOffer(pub, words.asBytes())));
+  }
+
+  idler.reset();
+  co_return position;
+}
+
+}
+
+// A serialised message shared between the broadcast publication and any
+// joins still in flight when it is superseded.
+struct AeronBroadcastStream::Snapshot
+  : kj::Refcounted {
+
+  explicit Snapshot(kj::ArrayPtr<kj::ArrayPtr<capnp::word const> const> segments)
+    : words_{capnp::messageToFlatArray(segments)}
+    , reader_{words_} {
+    auto builder = kj::heapArrayBuilder<kj::ArrayPtr<capnp::word const>>(segments.size());
+    for (auto ii = 0u; ii < segments.size(); ++ii) {
+      builder.add(reader_.getSegment(ii));
+    }
+    segments_ = builder.finish();
+  }
+
+  kj::Array<capnp::word> words_;
+  capnp::FlatArrayMessageReader reader_;
+  kj::Array<kj::ArrayPtr<capnp::word const>> segments_;
+};
+
+AeronBroadcastStream::AeronBroadcastStream(
+  ::aeron::ExclusivePublication& pub,
+  Idler& writeIdler)
+  : pub_{pub}
+  , writeIdler_{writeIdler} {
+}
+
+AeronBroadcastStream::~AeronBroadcastStream() {
+}
+
+kj::Promise<void> AeronBroadcastStream::writeMessage(
+    kj::ArrayPtr<kj::ArrayPtr<capnp::word const> const> segments) {
+  return aeroncap::writeMessage(writeIdler_, pub_, segments);
+}
+
+kj::Promise<void> AeronBroadcastStream::writeSnapshot(
+    kj::ArrayPtr<kj::ArrayPtr<capnp::word const> const> segments) {
+
+  auto snapshot = kj::refcounted<Snapshot>(segments);
+  auto promise = publish(writeIdler_, pub_, snapshot->segments_);
+
+  // only once published, lest a joiner get a snapshot subscribers never saw,
+  // and at the position it was published at, not that of whatever has been
+  // published since
+  return promise.then(
+    [this, snapshot = kj::mv(snapshot)](int64_t position) mutable {
+      snapshot_ = kj::mv(snapshot);
+      snapshotPosition_ = position;
+      auto joins = kj::mv(joins_);
+      for (auto& join: joins) {
+	join->fulfill();
+      }
+    }
+  );
+}
+
+kj::Promise<void> AeronBroadcastStream::join(
+    capnp::MessageStream& subscriber, int64_t joinPosition) {
+  while (snapshot_.get() == nullptr || snapshotPosition_ < joinPosition) {
+    auto paf = kj::newPromiseAndFulfiller<void>();
+    joins_.add(kj::mv(paf.fulfiller));
+    co_await paf.promise;
+  }
+
+  auto snapshot = kj::addRef(*snapshot_);
+  capnp::MallocMessageBuilder mb{capnp::sizeInWords<aeron::SnapshotHeader>() + 1};
+  mb.initRoot<aeron::SnapshotHeader>().setPosition(snapshotPosition_);
+  co_await subscriber.writeMessage(nullptr, mb.getSegmentsForOutput());
+  co_await subscriber.writeMessage(nullptr, snapshot->segments_);
+}
+
+kj::Promise<JoinedSnapshot> readSnapshot(capnp::MessageStream& stream) {
+  auto header = co_await stream.readMessage();
+  auto position = header->getRoot<aeron::SnapshotHeader>().getPosition();
+  auto snapshot = co_await stream.readMessage();
+  co_return JoinedSnapshot{kj::mv(snapshot), position};
+}
+
+kj::Promise<void> skipTo(Idler& idler, ::aeron::Image& image, int64_t position) {
+  while (image.position() < position) {
+    bool done = false;
+    auto fragmentsRead = image.controlledPoll(
+      [position, &done](auto&, auto, auto, auto& header) {
+	// the snapshot position falls between messages
+	if (header.position() <= position) {
+	  return ::aeron::ControlledPollAction::CONTINUE;
+	}
+	done = true;
+	return ::aeron::ControlledPollAction::ABORT;
+      },
+      16);
+
+    if (done || KJ_UNLIKELY(image.isEndOfStream())) {
+      break;
+    }
+    if (fragmentsRead) {
+      idler.reset();
+    }
+    else {
+      co_await idler.idle();
+    }
+  }
+  idler.reset();
+}
+
+}
@@ -0,0 +1,97 @@
+#pragma once
+// Copyright (c) 2023 Vaci Koblizek.
+// Licensed under the Apache 2.0 license found in the LICENSE file or at:
+//     https://opensource.org/licenses/Apache-2.0
+
+// One-to-many publication of capnp messages.
+//
+// Each message is serialised exactly once into a single publication, which
+// should be a multicast or multi-destination-cast channel, e.g.
+//     aeron:udp?endpoint=224.0.1.1:40456
+//     aeron:udp?control=server:40457|control-mode=dynamic
+// so that the cost of a write is independent of the number of subscribers.
+// Subscribers read the broadcast image with `readMessage`.
+//
+// A subscriber that joins late gets the latest snapshot over a stream of
+// its own, along with the position of the broadcast stream just after it,
+// and skips the messages of its image up to there with `skipTo`, as the
+// snapshot already reflects them.
+
+#include "serialize.h"
+
+#include <Aeron.h>
+#include <capnp/message.h>
+#include <capnp/serialize-async.h>
+#include <kj/refcount.h>
+#include <kj/vector.h>
+
+namespace aeroncap {
+
+struct AeronBroadcastStream {
+
+  // The publication is owned, and closed, by the caller.
+  AeronBroadcastStream(
+    ::aeron::ExclusivePublication&,
+    Idler& writeIdler
+  );
+
+  ~AeronBroadcastStream();
+
+  kj::Promise<void> writeMessage(
+    kj::ArrayPtr<kj::ArrayPtr<capnp::word const> const>);
+
+  kj::Promise<void> writeMessage(capnp::MessageBuilder& mb) {
+    return writeMessage(mb.getSegmentsForOutput());
+  }
+
+  // Publish a message and retain it as the snapshot delivered to
+  // subscribers that join late.
+  kj::Promise<void> writeSnapshot(
+    kj::ArrayPtr<kj::ArrayPtr<capnp::word const> const>);
+
+  kj::Promise<void> writeSnapshot(capnp::MessageBuilder& mb) {
+    return writeSnapshot(mb.getSegmentsForOutput());
+  }
+
+  // Deliver the latest snapshot to a late-joining subscriber over its own
+  // point-to-point stream, typically one returned by `Listener`, for it to
+  // read with `readSnapshot`. `joinPosition` is that of the subscriber's
+  // broadcast image, i.e. `Image::joinPosition`, which the subscriber must
+  // pass on, e.g. in the request to join. Messages published before it
+  // never reach the image, so the snapshot must be at least as recent, and
+  // until one is written the join waits for it.
+  kj::Promise<void> join(capnp::MessageStream& subscriber, int64_t joinPosition);
+
+  // Stream position of the broadcast publication just after the latest
+  // snapshot, or zero if none has been written.
+  int64_t snapshotPosition() const { return snapshotPosition_; }
+
+  bool isConnected() const { return pub_.isConnected(); }
+
+private:
+  struct Snapshot;
+
+  ::aeron::ExclusivePublication& pub_;
+  Idler& writeIdler_;
+
+  kj::Own<Snapshot> snapshot_;
+  int64_t snapshotPosition_{0};
+  // joins awaiting a more recent snapshot
+  kj::Vector<kj::Own<kj::PromiseFulfiller<void>>> joins_;
+};
+
+struct JoinedSnapshot {
+  kj::Own<capnp::MessageReader> snapshot;
+  // of the broadcast stream, just after the snapshot
+  int64_t position;
+};
+
+// Reads what `AeronBroadcastStream::join` writes to a subscriber.
+kj::Promise<JoinedSnapshot> readSnapshot(capnp::MessageStream&);
+
+// Discards the messages of a broadcast image up to `position`, as given by
+// `readSnapshot`, so that the next read is of the first message after the
+// snapshot.
+kj::Promise<void> skipTo(Idler&, ::aeron::Image&, int64_t position);
+
+}
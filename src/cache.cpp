@@ -0,0 +1,197 @@
+// Copyright (c) 2023 Vaci Koblizek.
+// Licensed under the Apache 2.0 license found in the LICENSE file or at:
+//     https://opensource.org/licenses/Apache-2.0
+
+#include "cache.h"
+
+#include <capnp/any.h>
+#include <capnp/message.h>
+
+namespace aeroncap {
+
+namespace {
+
+// `cacheable` in aeron-rpc.capnp
+constexpr uint64_t CACHEABLE_ANNOTATION_ID = 0xe3c1f86a2b94d057ull;
+
+}
+
+struct ResponseCache::Cacher final
+  : capnp::Capability::Server {
+
+  Cacher(
+    kj::Own<ResponseCache> cache,
+    capnp::Capability::Client target,
+    capnp::InterfaceSchema schema)
+    : cache_{kj::mv(cache)}
+    , target_{kj::mv(target)} {
+    addCacheable(schema);
+  }
+
+  DispatchCallResult dispatchCall(
+      uint64_t interfaceId, uint16_t methodId,
+      capnp::CallContext<capnp::AnyPointer, capnp::AnyPointer> context) override {
+
+    auto params = context.getParams();
+    auto size = params.targetSize();
+    KJ_IF_MAYBE(ttl, this->ttl(interfaceId, methodId)) {
+      if (size.capCount == 0) {
+	return cached(interfaceId, methodId, *ttl, context);
+      }
+    }
+
+    auto req = target_.typelessRequest(interfaceId, methodId, size, {});
+    req.set(params);
+    context.releaseParams();
+    return { context.tailCall(kj::mv(req)), false };
+  }
+
+private:
+  DispatchCallResult cached(
+      uint64_t interfaceId, uint16_t methodId, kj::Duration ttl,
+      capnp::CallContext<capnp::AnyPointer, capnp::AnyPointer> context) {
+
+    auto params = context.getParams();
+    auto canonical = params.getAs<capnp::AnyStruct>().canonicalize();
+
+    auto& cache = *cache_;
+    KJ_IF_MAYBE(words, cache.find({interfaceId, methodId, canonical})) {
+      context.releaseParams();
+      ++cache.stats_.hits;
+      kj::ArrayPtr<capnp::word const> segments[] = {*words};
+      capnp::SegmentArrayMessageReader reader{segments};
+      auto results = reader.getRoot<capnp::AnyPointer>();
+      context.getResults(results.targetSize()).set(results);
+      return { kj::READY_NOW, false };
+    }
+    ++cache.stats_.misses;
+
+    auto req = target_.typelessRequest(interfaceId, methodId, params.targetSize(), {});
+    req.set(params);
+    context.releaseParams();
+    auto promise = req.send().then(
+      [cache = kj::addRef(cache), interfaceId, methodId, ttl,
+       params = kj::mv(canonical), context]
+      (auto&& response) mutable {
+	auto size = response.targetSize();
+	context.getResults(size).set(response);
+	if (size.capCount == 0) {
+	  cache->insert(
+	    interfaceId, methodId, kj::mv(params),
+	    response.template getAs<capnp::AnyStruct>().canonicalize(), ttl);
+	}
+      });
+    return { kj::mv(promise), false };
+  }
+
+  void addCacheable(capnp::InterfaceSchema schema) {
+    auto interfaceId = schema.getProto().getId();
+    for (auto method: schema.getMethods()) {
+      for (auto annotation: method.getProto().getAnnotations()) {
+	if (annotation.getId() != CACHEABLE_ANNOTATION_ID) {
+	  continue;
+	}
+	auto& methods = cacheable_.findOrCreate(interfaceId, [interfaceId]() {
+	  return decltype(cacheable_)::Entry{interfaceId, {}};
+	});
+	auto ttl = annotation.getValue().getUint32() * kj::MILLISECONDS;
+	methods.upsert(method.getOrdinal(), ttl, [](auto&, auto) {});
+      }
+    }
+    for (auto superclass: schema.getSuperclasses()) {
+      addCacheable(superclass);
+    }
+  }
+
+  kj::Maybe<kj::Duration> ttl(uint64_t interfaceId, uint16_t methodId) const {
+    KJ_IF_MAYBE(methods, cacheable_.find(interfaceId)) {
+      KJ_IF_MAYBE(ttl, methods->find(methodId)) {
+	return *ttl;
+      }
+    }
+    return nullptr;
+  }
+
+  kj::Own<ResponseCache> cache_;
+  capnp::Capability::Client target_;
+  kj::HashMap<uint64_t, kj::HashMap<uint16_t, kj::Duration>> cacheable_;
+};
+
+ResponseCache::ResponseCache(kj::Timer& timer, size_t maxBytes)
+  : timer_{timer}
+  , maxBytes_{maxBytes} {
+}
+
+ResponseCache::~ResponseCache() {
+  clear();
+}
+
+capnp::Capability::Client ResponseCache::wrap(
+    capnp::Capability::Client cap, capnp::InterfaceSchema schema) {
+  return kj::heap<Cacher>(kj::addRef(*this), kj::mv(cap), schema);
+}
+
+void ResponseCache::clear() {
+  while (!lru_.empty()) {
+    erase(lru_.front());
+  }
+}
+
+kj::Maybe<kj::ArrayPtr<capnp::word const>> ResponseCache::find(Key const& key) {
+  KJ_IF_MAYBE(entry, entries_.find(key)) {
+    auto& e = **entry;
+    if (timer_.now() >= e.expiry) {
+      ++stats_.evictions;
+      erase(e);
+      return nullptr;
+    }
+    // most recently used
+    lru_.remove(e);
+    lru_.add(e);
+    return e.results.asPtr();
+  }
+  return nullptr;
+}
+
+void ResponseCache::insert(
+    uint64_t interfaceId, uint16_t methodId,
+    kj::Array<capnp::word> params, kj::Array<capnp::word> results,
+    kj::Duration ttl) {
+
+  auto entry = kj::heap<Entry>();
+  entry->interfaceId = interfaceId;
+  entry->methodId = methodId;
+  entry->params = kj::mv(params);
+  entry->results = kj::mv(results);
+  entry->expiry = timer_.now() + ttl;
+  auto byteSize = entry->byteSize();
+  if (byteSize > maxBytes_) {
+    return;
+  }
+
+  // a concurrent miss may have got here first
+  Key key{interfaceId, methodId, entry->params};
+  KJ_IF_MAYBE(existing, entries_.find(key)) {
+    erase(**existing);
+  }
+
+  while (stats_.bytes + byteSize > maxBytes_) {
+    ++stats_.evictions;
+    erase(lru_.front());
+  }
+
+  lru_.add(*entry);
+  stats_.bytes += byteSize;
+  ++stats_.entries;
+  entries_.insert(key, kj::mv(entry));
+}
+
+void ResponseCache::erase(Entry& entry) {
+  lru_.remove(entry);
+  stats_.bytes -= entry.byteSize();
+  --stats_.entries;
+  // last, as the key refers to the entry's params
+  entries_.erase(Key{entry.interfaceId, entry.methodId, entry.params});
+}
+
+}
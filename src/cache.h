@@ -0,0 +1,110 @@
+#pragma once
+// Copyright (c) 2023 Vaci Koblizek.
+// Licensed under the Apache 2.0 license found in the LICENSE file or at:
+//     https://opensource.org/licenses/Apache-2.0
+
+// A cache of the results of calls to methods annotated `$cacheable` from
+// aeron-rpc.capnp, keyed by the canonical encoding of their params, so
+// that repeated queries, e.g. for reference data, are answered without
+// being dispatched again.
+//
+// Results are kept in canonical form for the annotation's time to live,
+// and the least recently used are evicted to keep the cache within its
+// size. Calls whose params or results carry capabilities are never
+// cached, and neither are calls on the capabilities that calls return.
+
+#include <capnp/capability.h>
+#include <capnp/schema.h>
+#include <kj/hash.h>
+#include <kj/list.h>
+#include <kj/map.h>
+#include <kj/refcount.h>
+#include <kj/timer.h>
+
+namespace aeroncap {
+
+struct ResponseCache
+  : kj::Refcounted {
+
+  struct Stats {
+    uint64_t hits{0};
+    uint64_t misses{0};
+    // whether for size or age
+    uint64_t evictions{0};
+    size_t entries{0};
+    // of params and results held
+    size_t bytes{0};
+
+    double hitRate() const {
+      auto calls = hits + misses;
+      return calls ? double(hits) / calls : 0.0;
+    }
+  };
+
+  explicit ResponseCache(kj::Timer&, size_t maxBytes = 64u << 20);
+  ~ResponseCache();
+
+  template <typename T>
+  typename T::Client wrap(typename T::Client cap) {
+    return wrap(kj::mv(cap), capnp::Schema::from<T>()).template castAs<T>();
+  }
+
+  // Answers calls to the `$cacheable` methods of `schema` from the cache,
+  // and passes every other call through to `cap`. Every capability wrapped
+  // by the same cache shares its entries.
+  capnp::Capability::Client wrap(capnp::Capability::Client cap, capnp::InterfaceSchema schema);
+
+  Stats const& getStats() const { return stats_; }
+  void clear();
+
+private:
+  struct Cacher;
+
+  struct Key {
+    uint64_t interfaceId;
+    uint16_t methodId;
+    // canonical
+    kj::ArrayPtr<capnp::word const> params;
+
+    bool operator==(Key const& other) const {
+      return interfaceId == other.interfaceId
+	&& methodId == other.methodId
+	&& params.asBytes() == other.params.asBytes();
+    }
+
+    uint hashCode() const {
+      return kj::hashCode(interfaceId, methodId, params.asBytes());
+    }
+  };
+
+  struct Entry {
+    uint64_t interfaceId;
+    uint16_t methodId;
+    kj::Array<capnp::word> params;
+    kj::Array<capnp::word> results;
+    kj::TimePoint expiry{kj::origin<kj::TimePoint>()};
+    kj::ListLink<Entry> link;
+
+    size_t byteSize() const {
+      return params.asBytes().size() + results.asBytes().size();
+    }
+  };
+
+  // Canonical results, until they expire.
+  kj::Maybe<kj::ArrayPtr<capnp::word const>> find(Key const&);
+  void insert(
+    uint64_t interfaceId, uint16_t methodId,
+    kj::Array<capnp::word> params, kj::Array<capnp::word> results,
+    kj::Duration ttl);
+  void erase(Entry&);
+
+  kj::Timer& timer_;
+  size_t maxBytes_;
+  Stats stats_;
+  // keyed by views of each entry's own params
+  kj::HashMap<Key, kj::Own<Entry>> entries_;
+  // least recently used first
+  kj::List<Entry, &Entry::link> lru_;
+};
+
+}
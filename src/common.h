@@ -3,7 +3,9 @@
 // Licensed under the Apache 2.0 license found in the LICENSE file or at:
 //     https://opensource.org/licenses/Apache-2.0
 
+#include <kj/debug.h>
 #include <kj/exception.h>
+#include <kj/list.h>
 #include <kj/memory.h>
 
 namespace kj {
@@ -19,5 +21,46 @@ namespace aeroncap {
 
 kj::Exception toException(int err);
 
+// Unbounded FIFO queue
+template <typename T>
+struct Queue {
+  Queue() {}
+
+  ~Queue() {
+    while (!empty()) {
+      pop();
+    }
+  }
+
+  bool empty() const {
+    return items.empty();
+  }
+
+  size_t size() const {
+    return items.size();
+  }
+  
+  void push(T&& element) {
+    auto entry = new Entry{ .item = kj::mv(element) };
+    items.add(*entry);
+  }
+
+  T pop() {
+    KJ_IREQUIRE(!empty());
+    auto& entry = items.front();
+    items.remove(entry);
+    auto item = kj::mv(entry.item);
+    delete &entry;
+    return item;
+  }
+
+private:
+  struct Entry {
+    kj::ListLink<Entry> link;
+    T item;
+  };
+
+  kj::List<Entry, &Entry::link> items;
+};
 
 }
@@ -0,0 +1,154 @@
+// Copyright (c) 2023 Vaci Koblizek.
+// Licensed under the Apache 2.0 license found in the LICENSE file or at:
+//     https://opensource.org/licenses/Apache-2.0
+
+#include "driver.h"
+
+#include <kj/debug.h>
+#include <kj/filesystem.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace aeroncap {
+
+namespace {
+
+void check(int result, kj::StringPtr what) {
+  if (result) {
+    auto errcode = aeron_errcode();
+    auto errmsg = aeron_errmsg();
+    KJ_FAIL_REQUIRE("Embedded media driver", what, errcode, errmsg);
+  }
+}
+
+aeron_threading_mode_t toAeron(DriverThreading threading) {
+  switch (threading) {
+    case DriverThreading::DEDICATED:
+      return AERON_THREADING_MODE_DEDICATED;
+    case DriverThreading::SHARED_NETWORK:
+      return AERON_THREADING_MODE_SHARED_NETWORK;
+    case DriverThreading::SHARED:
+      return AERON_THREADING_MODE_SHARED;
+  }
+  KJ_UNREACHABLE;
+}
+
+kj::String tempDir() {
+  auto dir = kj::str("/tmp/aeron-driver.XXXXXX");
+  KJ_REQUIRE(mkdtemp(dir.begin()) != nullptr, "mkdtemp", strerror(errno));
+  return dir;
+}
+
+void pin(int cpu) {
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(cpu, &cpus);
+  if (auto err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus)) {
+    KJ_LOG(ERROR, "Failed to pin the media driver", cpu, strerror(err));
+  }
+}
+
+}
+
+EmbeddedDriver::EmbeddedDriver(DriverOptions options) {
+  start(options);
+  runner_ = kj::heap<kj::Thread>([this, cpu = options.cpu]() {
+    KJ_IF_MAYBE(c, cpu) {
+      pin(*c);
+    }
+    while (running_.load(std::memory_order_acquire)) {
+      auto count = aeron_driver_main_do_work(driver_);
+      aeron_driver_main_idle_strategy(driver_, count);
+    }
+  });
+}
+
+EmbeddedDriver::EmbeddedDriver(Idler& idler, DriverOptions options) {
+  start(options);
+  task_ = dutyCycle(idler).eagerlyEvaluate([](kj::Exception&& exc) {
+    KJ_LOG(ERROR, "Media driver duty cycle failed", exc);
+  });
+}
+
+EmbeddedDriver::~EmbeddedDriver() noexcept {
+  running_.store(false, std::memory_order_release);
+  runner_ = nullptr;
+  task_ = nullptr;
+  close();
+}
+
+void EmbeddedDriver::close() {
+  if (driver_ && aeron_driver_close(driver_)) {
+    KJ_LOG(ERROR, "aeron_driver_close", aeron_errcode(), aeron_errmsg());
+  }
+  driver_ = nullptr;
+  if (context_ && aeron_driver_context_close(context_)) {
+    KJ_LOG(ERROR, "aeron_driver_context_close", aeron_errcode(), aeron_errmsg());
+  }
+  context_ = nullptr;
+}
+
+void EmbeddedDriver::start(DriverOptions& options) {
+  tempDir_ = options.dir.size() == 0;
+  dir_ = tempDir_ ? tempDir() : kj::str(options.dir);
+
+  // the destructor won't run if the constructor throws
+  KJ_ON_SCOPE_FAILURE({
+    close();
+    if (tempDir_) {
+      KJ_IF_MAYBE(exc, kj::runCatchingExceptions([this]() {
+	// absolute, as made by tempDir()
+	kj::newDiskFilesystem()->getRoot().tryRemove(kj::Path::parse(dir_.slice(1)));
+      })) {
+	KJ_LOG(ERROR, "Failed to remove the driver directory", dir_, *exc);
+      }
+    }
+  });
+
+  check(aeron_driver_context_init(&context_), "aeron_driver_context_init");
+  aeron_driver_context_set_print_configuration(context_, false);
+  aeron_driver_context_set_threading_mode(context_, toAeron(options.threading));
+  aeron_driver_context_set_dir(context_, dir_.cStr());
+  // never another's, which a live driver may be using
+  aeron_driver_context_set_dir_delete_on_start(context_, tempDir_);
+  aeron_driver_context_set_dir_delete_on_shutdown(context_, true);
+  KJ_IF_MAYBE(sparse, options.sparseTermBuffers) {
+    aeron_driver_context_set_term_buffer_sparse_file(context_, *sparse);
+  }
+
+  auto idleStrategy = options.idleStrategy.cStr();
+  aeron_driver_context_set_conductor_idle_strategy(context_, idleStrategy);
+  aeron_driver_context_set_sender_idle_strategy(context_, idleStrategy);
+  aeron_driver_context_set_receiver_idle_strategy(context_, idleStrategy);
+  aeron_driver_context_set_sharednetwork_idle_strategy(context_, idleStrategy);
+  aeron_driver_context_set_shared_idle_strategy(context_, idleStrategy);
+
+  KJ_IF_MAYBE(configure, options.configure) {
+    (*configure)(context_);
+  }
+
+  check(aeron_driver_init(&driver_, context_), "aeron_driver_init");
+  // the main duty cycle is ours to run
+  check(aeron_driver_start(driver_, true), "aeron_driver_start");
+}
+
+kj::Promise<void> EmbeddedDriver::dutyCycle(Idler& idler) {
+  while (true) {
+    if (aeron_driver_main_do_work(driver_)) {
+      idler.reset();
+    }
+    co_await idler.idle();
+  }
+}
+
+std::shared_ptr<::aeron::Aeron> EmbeddedDriver::connect() const {
+  ::aeron::Context context;
+  context.aeronDir(dir_.cStr());
+  return ::aeron::Aeron::connect(context);
+}
+
+}
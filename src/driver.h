@@ -0,0 +1,100 @@
+#pragma once
+// Copyright (c) 2023 Vaci Koblizek.
+// Licensed under the Apache 2.0 license found in the LICENSE file or at:
+//     https://opensource.org/licenses/Apache-2.0
+
+// A media driver embedded in the process, for single process deployments
+// and tests, rather than one provisioned alongside it.
+//
+// The driver's main duty cycle, i.e. its conductor, and in the shared
+// threading mode its sender and receiver too, runs either on a thread of
+// its own or in the event loop of the thread that constructs it. In the
+// latter case, a colocated client and server take no thread hops through
+// the driver at all, at the cost of the duty cycle sharing the loop, and
+// blocking calls into the Aeron client, such as polling for a publication
+// in a loop, must not be made on that thread.
+
+#include "idle.h"
+
+#include <Aeron.h>
+#include <aeronmd/aeronmd.h>
+
+#include <kj/async.h>
+#include <kj/function.h>
+#include <kj/string.h>
+#include <kj/thread.h>
+
+#include <atomic>
+
+namespace aeroncap {
+
+enum class DriverThreading {
+  // conductor, sender and receiver each on their own thread
+  DEDICATED,
+  // sender and receiver sharing a thread
+  SHARED_NETWORK,
+  // everything in the one duty cycle
+  SHARED
+};
+
+struct DriverOptions {
+  DriverThreading threading{DriverThreading::SHARED};
+
+  // Idle strategy of the driver's own threads, by name, e.g. "backoff",
+  // "sleeping" or "noop".
+  kj::StringPtr idleStrategy{"backoff"};
+
+  // Pins the driver's own thread, which runs the main duty cycle, to a
+  // core. Ignored when the duty cycle runs in the caller's event loop, as
+  // the caller's thread is the caller's to pin.
+  kj::Maybe<int> cpu;
+
+  // Whether term buffers are sparse files, which spares zeroing them up
+  // front at the cost of page faults while they are first written. Unset
+  // leaves the driver's own default, or AERON_TERM_BUFFER_SPARSE_FILE, in
+  // place, and channels may still override it with `sparse=`.
+  kj::Maybe<bool> sparseTermBuffers;
+
+  // The driver directory, which is otherwise a fresh temporary one. Unlike
+  // a temporary one, it is not cleared on start, so a driver already
+  // running there makes this one fail rather than lose its files.
+  kj::StringPtr dir;
+
+  // Any further configuration, applied last.
+  kj::Maybe<kj::Function<void(aeron_driver_context_t*)>> configure;
+};
+
+struct EmbeddedDriver {
+
+  // Runs the main duty cycle on a thread of its own.
+  explicit EmbeddedDriver(DriverOptions = {});
+
+  // Runs the main duty cycle in the current thread's event loop, idling
+  // with `idler` whenever the driver has no work.
+  EmbeddedDriver(Idler& idler, DriverOptions = {});
+
+  ~EmbeddedDriver() noexcept;
+
+  KJ_DISALLOW_COPY_AND_MOVE(EmbeddedDriver);
+
+  kj::StringPtr getDir() const { return dir_; }
+
+  // Connects a client to the driver.
+  std::shared_ptr<::aeron::Aeron> connect() const;
+
+private:
+  void start(DriverOptions&);
+  void close();
+  kj::Promise<void> dutyCycle(Idler&);
+
+  kj::String dir_;
+  bool tempDir_{false};
+  aeron_driver_context_t* context_{};
+  aeron_driver_t* driver_{};
+
+  std::atomic<bool> running_{true};
+  kj::Own<kj::Thread> runner_;
+  kj::Promise<void> task_{nullptr};
+};
+
+}
@@ -0,0 +1,157 @@
+// Copyright (c) 2023 Vaci Koblizek.
+// Licensed under the Apache 2.0 license found in the LICENSE file or at:
+//     https://opensource.org/licenses/Apache-2.0
+
+#include "hedge.h"
+
+#include <kj/map.h>
+#include <kj/refcount.h>
+
+namespace aeroncap {
+
+namespace {
+
+// `idempotent` in aeron-rpc.capnp
+constexpr uint64_t IDEMPOTENT_ANNOTATION_ID = 0xd2a7c4e19b3f6058ull;
+
+// Refcounted, so that the hedge can be forked.
+struct Reply
+  : kj::Refcounted {
+
+  Reply(capnp::Response<capnp::AnyPointer>&& response, bool primary)
+    : response{kj::mv(response)}
+    , primary{primary} {
+  }
+
+  capnp::Response<capnp::AnyPointer> response;
+  bool primary;
+};
+
+}
+
+struct HedgedClient::Hedger final
+  : capnp::Capability::Server {
+
+  Hedger(
+    HedgedClient& client,
+    capnp::InterfaceSchema schema)
+    : client_{client}
+    , primary_{client.primary_.bootstrap()}
+    , secondary_{client.secondary_.bootstrap()} {
+    addIdempotent(schema);
+  }
+
+  DispatchCallResult dispatchCall(
+      uint64_t interfaceId, uint16_t methodId,
+      capnp::CallContext<capnp::AnyPointer, capnp::AnyPointer> context) override {
+
+    auto params = context.getParams();
+    auto size = params.targetSize();
+    auto primaryReq = primary_.typelessRequest(interfaceId, methodId, size, {});
+    primaryReq.set(params);
+
+    if (!isIdempotent(interfaceId, methodId)) {
+      context.releaseParams();
+      return { context.tailCall(kj::mv(primaryReq)), false };
+    }
+
+    auto secondaryReq = secondary_.typelessRequest(interfaceId, methodId, size, {});
+    secondaryReq.set(params);
+    context.releaseParams();
+
+    auto& stats = client_.stats_;
+    ++stats.calls;
+
+    // the hedge goes out after the delay, or as soon as the primary fails
+    auto trigger = kj::newPromiseAndFulfiller<void>();
+    auto delay = client_.delay_;
+    auto start = delay == 0 * kj::NANOSECONDS
+      ? kj::Promise<void>{kj::READY_NOW}
+      : client_.timer_.afterDelay(delay).exclusiveJoin(kj::mv(trigger.promise));
+
+    auto hedge = start.then(
+      [&stats, req = kj::mv(secondaryReq)]() mutable {
+	++stats.hedged;
+	return req.send();
+      }).then([](auto&& response) {
+	return kj::refcounted<Reply>(kj::mv(response), false);
+      }).fork();
+
+    auto primary = primaryReq.send().then(
+      [](auto&& response) -> kj::Promise<kj::Own<Reply>> {
+	return kj::refcounted<Reply>(kj::mv(response), true);
+      },
+      [fulfiller = kj::mv(trigger.fulfiller), hedge = hedge.addBranch()]
+      (kj::Exception&& exc) mutable -> kj::Promise<kj::Own<Reply>> {
+	fulfiller->fulfill();
+	// whether it succeeds or fails
+	return kj::mv(hedge);
+      });
+
+    // a failed hedge leaves the primary to answer
+    auto secondary = hedge.addBranch().catch_(
+      [](kj::Exception&&) -> kj::Promise<kj::Own<Reply>> {
+	return kj::NEVER_DONE;
+      });
+
+    auto promise = primary.exclusiveJoin(kj::mv(secondary)).then(
+      [&stats, context](kj::Own<Reply>&& reply) mutable {
+	++(reply->primary ? stats.primaryWins : stats.secondaryWins);
+	context.getResults(reply->response.targetSize()).set(reply->response);
+      });
+    return { kj::mv(promise), false };
+  }
+
+private:
+  void addIdempotent(capnp::InterfaceSchema schema) {
+    auto interfaceId = schema.getProto().getId();
+    for (auto method: schema.getMethods()) {
+      for (auto annotation: method.getProto().getAnnotations()) {
+	if (annotation.getId() != IDEMPOTENT_ANNOTATION_ID) {
+	  continue;
+	}
+	auto& methods = idempotent_.findOrCreate(interfaceId, [interfaceId]() {
+	  return decltype(idempotent_)::Entry{interfaceId, {}};
+	});
+	methods.upsert(method.getOrdinal(), [](auto&, auto) {});
+      }
+    }
+    for (auto superclass: schema.getSuperclasses()) {
+      addIdempotent(superclass);
+    }
+  }
+
+  bool isIdempotent(uint64_t interfaceId, uint16_t methodId) const {
+    KJ_IF_MAYBE(methods, idempotent_.find(interfaceId)) {
+      return methods->contains(methodId);
+    }
+    return false;
+  }
+
+  HedgedClient& client_;
+  capnp::Capability::Client primary_;
+  capnp::Capability::Client secondary_;
+  kj::HashMap<uint64_t, kj::HashSet<uint16_t>> idempotent_;
+};
+
+HedgedClient::HedgedClient(
+  kj::Timer& timer,
+  kj::Own<AeronMessageStreamBase> primary,
+  kj::Own<AeronMessageStreamBase> secondary,
+  kj::Duration delay)
+  : timer_{timer}
+  , primaryStream_{kj::mv(primary)}
+  , secondaryStream_{kj::mv(secondary)}
+  , primary_{*primaryStream_}
+  , secondary_{*secondaryStream_}
+  , delay_{delay} {
+}
+
+HedgedClient::~HedgedClient() {
+}
+
+capnp::Capability::Client HedgedClient::bootstrap(capnp::InterfaceSchema schema) {
+  return kj::heap<Hedger>(*this, schema);
+}
+
+}
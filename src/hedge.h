@@ -0,0 +1,70 @@
+#pragma once
+// Copyright (c) 2023 Vaci Koblizek.
+// Licensed under the Apache 2.0 license found in the LICENSE file or at:
+//     https://opensource.org/licenses/Apache-2.0
+
+// Hedged calls over two connections to the same service, typically over
+// different channels or interfaces, so that a loss and its retransmission
+// on one path doesn't hold up a call that the other could have answered.
+//
+// Calls to methods annotated `$idempotent` from aeron-rpc.capnp are sent
+// over the primary connection, then after the hedge delay over the
+// secondary too, or at once should the primary fail, and the first reply
+// wins. Other calls only ever use the primary connection. Capabilities
+// returned by a call belong to the connection that won it.
+
+#include "aeron-rpc.h"
+
+#include <capnp/capability.h>
+#include <capnp/schema.h>
+#include <kj/timer.h>
+
+namespace aeroncap {
+
+struct HedgedClient {
+
+  struct Stats {
+    // idempotent calls made
+    uint64_t calls{0};
+    // of which, also sent over the secondary
+    uint64_t hedged{0};
+    // replies taken from each connection
+    uint64_t primaryWins{0};
+    uint64_t secondaryWins{0};
+
+    double hedgeRate() const { return calls ? double(hedged) / calls : 0.0; }
+  };
+
+  // A zero delay hedges every idempotent call immediately.
+  HedgedClient(
+    kj::Timer&,
+    kj::Own<AeronMessageStreamBase> primary,
+    kj::Own<AeronMessageStreamBase> secondary,
+    kj::Duration delay = 0 * kj::NANOSECONDS);
+
+  ~HedgedClient();
+
+  template <typename T>
+  typename T::Client bootstrap() {
+    return bootstrap(capnp::Schema::from<T>()).template castAs<T>();
+  }
+
+  // The client must outlive the capability.
+  capnp::Capability::Client bootstrap(capnp::InterfaceSchema);
+
+  Stats const& getStats() const { return stats_; }
+  void setDelay(kj::Duration delay) { delay_ = delay; }
+
+private:
+  struct Hedger;
+
+  kj::Timer& timer_;
+  kj::Own<AeronMessageStreamBase> primaryStream_;
+  kj::Own<AeronMessageStreamBase> secondaryStream_;
+  TwoPartyClient primary_;
+  TwoPartyClient secondary_;
+  kj::Duration delay_;
+  Stats stats_;
+};
+
+}
@@ -0,0 +1,54 @@
+// Copyright (c) 2023 Vaci Koblizek.
+// Licensed under the Apache 2.0 license found in the LICENSE file or at:
+//     https://opensource.org/licenses/Apache-2.0
+
+#include "histogram.h"
+#include <kj/main.h>
+#include <gtest/gtest.h>
+
+using namespace aeroncap;
+
+TEST(Histogram, Buckets) {
+  for (uint64_t value: {0ull, 1ull, 63ull, 64ull, 65ull, 1000ull, 123456789ull, UINT64_MAX}) {
+    auto index = Histogram::indexOf(value);
+    EXPECT_LT(index, Histogram::BUCKET_COUNT);
+    auto highest = Histogram::highestEquivalentValue(index);
+    EXPECT_GE(highest, value);
+    // within 1/32 of the value
+    EXPECT_LE(highest - value, value / Histogram::SUB_BUCKET_COUNT);
+  }
+  EXPECT_EQ(Histogram::indexOf(UINT64_MAX), Histogram::BUCKET_COUNT - 1);
+}
+
+TEST(Histogram, Percentiles) {
+  Histogram histogram;
+  for (auto ii = 1u; ii <= 1000; ++ii) {
+    histogram.record(ii * 1000);
+  }
+  EXPECT_EQ(histogram.count(), 1000u);
+  EXPECT_EQ(histogram.min(), 1000u);
+  EXPECT_EQ(histogram.max(), 1000000u);
+
+  auto p50 = histogram.valueAtPercentile(50.0);
+  EXPECT_GE(p50, 500000u);
+  EXPECT_LE(p50, 500000u + 500000u / Histogram::SUB_BUCKET_COUNT);
+  EXPECT_EQ(histogram.valueAtPercentile(100.0), 1000000u);
+
+  Histogram other;
+  other.record(5);
+  histogram.merge(other);
+  EXPECT_EQ(histogram.count(), 1001u);
+  EXPECT_EQ(histogram.min(), 5u);
+
+  histogram.reset();
+  EXPECT_EQ(histogram.count(), 0u);
+  EXPECT_EQ(histogram.valueAtPercentile(99.0), 0u);
+}
+
+int main(int argc, char* argv[]) {
+  kj::TopLevelProcessContext processCtx{argv[0]};
+  processCtx.increaseLoggingVerbosity();
+
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
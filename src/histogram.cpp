@@ -0,0 +1,106 @@
+// Copyright (c) 2023 Vaci Koblizek.
+// Licensed under the Apache 2.0 license found in the LICENSE file or at:
+//     https://opensource.org/licenses/Apache-2.0
+
+#include "histogram.h"
+
+#include <kj/debug.h>
+
+#include <string.h>
+
+namespace aeroncap {
+
+Histogram::Histogram()
+  : counts_{kj::heapArray<uint64_t>(BUCKET_COUNT)} {
+  reset();
+}
+
+uint32_t Histogram::indexOf(uint64_t value) {
+  if (value < 2 * SUB_BUCKET_COUNT) {
+    return value;
+  }
+  uint32_t exponent = 63 - __builtin_clzll(value);
+  auto shift = exponent - SUB_BUCKET_BITS;
+  auto top = static_cast<uint32_t>(value >> shift);
+  return 2 * SUB_BUCKET_COUNT + (shift - 1) * SUB_BUCKET_COUNT + (top - SUB_BUCKET_COUNT);
+}
+
+uint64_t Histogram::highestEquivalentValue(uint32_t index) {
+  if (index < 2 * SUB_BUCKET_COUNT) {
+    return index;
+  }
+  index -= 2 * SUB_BUCKET_COUNT;
+  auto shift = index / SUB_BUCKET_COUNT + 1;
+  uint64_t top = index % SUB_BUCKET_COUNT + SUB_BUCKET_COUNT;
+  // wraps to the greatest value for the very last bucket
+  return ((top + 1) << shift) - 1;
+}
+
+void Histogram::record(uint64_t value, uint64_t count) {
+  counts_[indexOf(value)] += count;
+  count_ += count;
+  total_ += value * count;
+  min_ = kj::min(min_, value);
+  max_ = kj::max(max_, value);
+}
+
+void Histogram::merge(Histogram const& other) {
+  for (auto ii = 0u; ii < BUCKET_COUNT; ++ii) {
+    counts_[ii] += other.counts_[ii];
+  }
+  count_ += other.count_;
+  total_ += other.total_;
+  min_ = kj::min(min_, other.min_);
+  max_ = kj::max(max_, other.max_);
+}
+
+void Histogram::reset() {
+  memset(counts_.begin(), 0, counts_.asBytes().size());
+  count_ = 0;
+  total_ = 0;
+  min_ = UINT64_MAX;
+  max_ = 0;
+}
+
+double Histogram::mean() const {
+  return count_ ? static_cast<double>(total_) / count_ : 0.0;
+}
+
+uint64_t Histogram::valueAtPercentile(double percentile) const {
+  if (count_ == 0) {
+    return 0;
+  }
+  auto target = static_cast<uint64_t>(percentile / 100.0 * count_ + 0.5);
+  target = kj::max(kj::min(target, count_), uint64_t{1});
+
+  uint64_t seen = 0;
+  for (auto ii = 0u; ii < BUCKET_COUNT; ++ii) {
+    seen += counts_[ii];
+    if (seen >= target) {
+      return kj::min(highestEquivalentValue(ii), max_);
+    }
+  }
+  return max_;
+}
+
+void Histogram::forEach(kj::FunctionParam<void(uint64_t, uint64_t)> func) const {
+  for (auto ii = 0u; ii < BUCKET_COUNT; ++ii) {
+    if (counts_[ii]) {
+      func(highestEquivalentValue(ii), counts_[ii]);
+    }
+  }
+}
+
+kj::String Histogram::toString() const {
+  return kj::str(
+    "count=", count(),
+    " min=", min(),
+    " mean=", static_cast<uint64_t>(mean()),
+    " p50=", valueAtPercentile(50.0),
+    " p90=", valueAtPercentile(90.0),
+    " p99=", valueAtPercentile(99.0),
+    " p99.9=", valueAtPercentile(99.9),
+    " max=", max());
+}
+
+}
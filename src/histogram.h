@@ -0,0 +1,58 @@
+#pragma once
+// Copyright (c) 2023 Vaci Koblizek.
+// Licensed under the Apache 2.0 license found in the LICENSE file or at:
+//     https://opensource.org/licenses/Apache-2.0
+
+#include <kj/array.h>
+#include <kj/function.h>
+#include <kj/string.h>
+
+#include <cstdint>
+
+namespace aeroncap {
+
+// A log-linear histogram in the manner of HdrHistogram: values are counted
+// exactly below 64, and above that in buckets of 1/32 of each power of two,
+// so that any value is reported to within about 3%, whatever its
+// magnitude. Recording is a few instructions and never allocates.
+struct Histogram {
+
+  Histogram();
+
+  void record(uint64_t value, uint64_t count = 1);
+  void merge(Histogram const&);
+  void reset();
+
+  uint64_t count() const { return count_; }
+  uint64_t min() const { return count_ ? min_ : 0; }
+  uint64_t max() const { return max_; }
+  double mean() const;
+
+  // The least value that at least `percentile` percent of the recorded
+  // values are equivalent to or below.
+  uint64_t valueAtPercentile(double percentile) const;
+
+  // Calls `func` with the highest equivalent value and count of each
+  // non-empty bucket, in increasing order of value, e.g. for export.
+  void forEach(kj::FunctionParam<void(uint64_t value, uint64_t count)> func) const;
+
+  // Count, min, mean, max and the usual percentiles, on a single line.
+  kj::String toString() const;
+
+  static constexpr uint32_t SUB_BUCKET_BITS = 5;
+  static constexpr uint32_t SUB_BUCKET_COUNT = 1u << SUB_BUCKET_BITS;
+  static constexpr uint32_t BUCKET_COUNT = 2 * SUB_BUCKET_COUNT
+    + (64 - SUB_BUCKET_BITS - 1) * SUB_BUCKET_COUNT;
+
+  static uint32_t indexOf(uint64_t value);
+  static uint64_t highestEquivalentValue(uint32_t index);
+
+private:
+  kj::Array<uint64_t> counts_;
+  uint64_t count_{0};
+  uint64_t total_{0};
+  uint64_t min_{UINT64_MAX};
+  uint64_t max_{0};
+};
+
+}
@@ -0,0 +1,164 @@
+// Copyright (c) 2023 Vaci Koblizek.
+// Licensed under the Apache 2.0 license found in the LICENSE file or at:
+//     https://opensource.org/licenses/Apache-2.0
+
+#include "instrument.h"
+
+#include <capnp/membrane.h>
+#include <kj/vector.h>
+
+namespace aeroncap {
+
+namespace {
+
+uint64_t byteSize(capnp::MessageSize size) {
+  return size.wordCount * sizeof(capnp::word);
+}
+
+}
+
+struct Instrumentation::Policy final
+  : capnp::MembranePolicy
+  , kj::Refcounted {
+
+  explicit Policy(kj::Own<Instrumentation> instrumentation)
+    : instrumentation_{kj::mv(instrumentation)} {
+  }
+
+  kj::Maybe<capnp::Capability::Client> inboundCall(
+      uint64_t, uint16_t, capnp::Capability::Client target) override;
+
+  kj::Maybe<capnp::Capability::Client> outboundCall(
+      uint64_t, uint16_t, capnp::Capability::Client) override {
+    return nullptr;
+  }
+
+  kj::Own<capnp::MembranePolicy> addRef() override {
+    return kj::addRef(*this);
+  }
+
+  kj::Own<Instrumentation> instrumentation_;
+};
+
+// A single call into the membrane, redirected here so that it can be
+// timed, and its results wrapped.
+struct Instrumentation::Call final
+  : capnp::Capability::Server {
+
+  Call(kj::Own<Policy> policy, capnp::Capability::Client target, kj::TimePoint arrival)
+    : policy_{kj::mv(policy)}
+    , target_{kj::mv(target)}
+    , arrival_{arrival} {
+  }
+
+  DispatchCallResult dispatchCall(
+      uint64_t interfaceId, uint16_t methodId,
+      capnp::CallContext<capnp::AnyPointer, capnp::AnyPointer> context) override {
+
+    auto& instrumentation = *policy_->instrumentation_;
+    auto& method = instrumentation.method(interfaceId, methodId);
+    auto& clock = instrumentation.clock_;
+    auto start = clock.now();
+    ++method.calls;
+    method.queueTime.record((start - arrival_) / kj::NANOSECONDS);
+
+    auto params = context.getParams();
+    auto size = params.targetSize();
+    method.requestSize.record(byteSize(size));
+    auto req = target_.typelessRequest(interfaceId, methodId, size, {});
+    req.set(params);
+    context.releaseParams();
+
+    auto promise = req.send().then(
+      [&method, &clock, start, context, policy = kj::addRef(*policy_)]
+      (auto&& response) mutable {
+	method.executionTime.record((clock.now() - start) / kj::NANOSECONDS);
+	auto size = response.targetSize();
+	method.responseSize.record(byteSize(size));
+	auto results = context.getResults(size);
+	// out of the membrane, so that calls on any capabilities among the
+	// results are counted too
+	results.adopt(capnp::copyOutOfMembrane(
+	  response, capnp::Orphanage::getForMessageContaining(results), kj::mv(policy)));
+      },
+      [&method](kj::Exception&& exc) {
+	++method.failures;
+	kj::throwFatalException(kj::mv(exc));
+      });
+    return { kj::mv(promise), false };
+  }
+
+private:
+  kj::Own<Policy> policy_;
+  capnp::Capability::Client target_;
+  kj::TimePoint arrival_;
+};
+
+kj::Maybe<capnp::Capability::Client> Instrumentation::Policy::inboundCall(
+    uint64_t, uint16_t, capnp::Capability::Client target) {
+  auto arrival = instrumentation_->clock_.now();
+  return capnp::Capability::Client{
+    kj::heap<Call>(kj::addRef(*this), kj::mv(target), arrival)};
+}
+
+Instrumentation::Instrumentation(kj::MonotonicClock const& clock)
+  : clock_{clock} {
+}
+
+Instrumentation::~Instrumentation() {
+}
+
+capnp::Capability::Client Instrumentation::wrap(capnp::Capability::Client cap) {
+  return capnp::membrane(kj::mv(cap), kj::refcounted<Policy>(kj::addRef(*this)));
+}
+
+Instrumentation::Method& Instrumentation::method(uint64_t interfaceId, uint16_t methodId) {
+  auto& methods = methods_.findOrCreate(interfaceId, [interfaceId]() {
+    return decltype(methods_)::Entry{interfaceId, {}};
+  });
+  auto& method = methods.findOrCreate(methodId, [interfaceId, methodId]() {
+    auto method = kj::heap<Method>();
+    method->interfaceId = interfaceId;
+    method->methodId = methodId;
+    return kj::HashMap<uint16_t, kj::Own<Method>>::Entry{methodId, kj::mv(method)};
+  });
+  return *method;
+}
+
+kj::Array<Instrumentation::Method> Instrumentation::snapshot() const {
+  kj::Vector<Method> snapshot;
+  for (auto& byInterface: methods_) {
+    for (auto& entry: byInterface.value) {
+      auto& method = *entry.value;
+      if (method.calls == 0) {
+	continue;
+      }
+      Method copy{.interfaceId = method.interfaceId, .methodId = method.methodId};
+      copy.calls = method.calls;
+      copy.failures = method.failures;
+      copy.queueTime.merge(method.queueTime);
+      copy.executionTime.merge(method.executionTime);
+      copy.requestSize.merge(method.requestSize);
+      copy.responseSize.merge(method.responseSize);
+      snapshot.add(kj::mv(copy));
+    }
+  }
+  return snapshot.releaseAsArray();
+}
+
+void Instrumentation::reset() {
+  // in place, as calls in flight still refer to them
+  for (auto& byInterface: methods_) {
+    for (auto& entry: byInterface.value) {
+      auto& method = *entry.value;
+      method.calls = 0;
+      method.failures = 0;
+      method.queueTime.reset();
+      method.executionTime.reset();
+      method.requestSize.reset();
+      method.responseSize.reset();
+    }
+  }
+}
+
+}
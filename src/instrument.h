@@ -0,0 +1,67 @@
+#pragma once
+// Copyright (c) 2023 Vaci Koblizek.
+// Licensed under the Apache 2.0 license found in the LICENSE file or at:
+//     https://opensource.org/licenses/Apache-2.0
+
+// Per-method statistics of the calls made on a capability, and on every
+// capability its calls return, for finding out which methods are slow
+// under real load.
+//
+// A wrapped capability sits behind a membrane, and each call into it is
+// timed from reaching the membrane to being dispatched, i.e. queueing in
+// the event loop, and from then on until its results are ready. The
+// results are copied back through the membrane, so that the capabilities
+// among them are wrapped in turn, and calls pipelined on them wait for the
+// results rather than being forwarded early.
+
+#include "histogram.h"
+
+#include <capnp/capability.h>
+#include <kj/map.h>
+#include <kj/refcount.h>
+#include <kj/time.h>
+
+namespace aeroncap {
+
+struct Instrumentation
+  : kj::Refcounted {
+
+  struct Method {
+    uint64_t interfaceId;
+    uint16_t methodId;
+    uint64_t calls{0};
+    uint64_t failures{0};
+    // nanoseconds
+    Histogram queueTime;
+    Histogram executionTime;
+    // bytes of the params and results, capability table excluded
+    Histogram requestSize;
+    Histogram responseSize;
+  };
+
+  explicit Instrumentation(
+    kj::MonotonicClock const& clock = kj::systemPreciseMonotonicClock());
+
+  ~Instrumentation();
+
+  // Records the calls made on `cap`, and on capabilities returned by them.
+  capnp::Capability::Client wrap(capnp::Capability::Client cap);
+
+  // A copy of the statistics so far, of each method called at least once.
+  kj::Array<Method> snapshot() const;
+
+  // Starts afresh, e.g. at the start of each reporting period.
+  void reset();
+
+private:
+  struct Policy;
+  struct Call;
+
+  Method& method(uint64_t interfaceId, uint16_t methodId);
+
+  kj::MonotonicClock const& clock_;
+  // owned, so that calls in flight can hold on to their method's entry
+  kj::HashMap<uint64_t, kj::HashMap<uint16_t, kj::Own<Method>>> methods_;
+};
+
+}
@@ -0,0 +1,98 @@
+// Copyright (c) 2023 Vaci Koblizek.
+// Licensed under the Apache 2.0 license found in the LICENSE file or at:
+//     https://opensource.org/licenses/Apache-2.0
+
+#include "lanes.h"
+
+#include <kj/map.h>
+
+namespace aeroncap {
+
+namespace {
+
+// `lane` in aeron-rpc.capnp
+constexpr uint64_t LANE_ANNOTATION_ID = 0xb5f1c3e07a2d4e91ull;
+
+struct LaneRouter final
+  : capnp::Capability::Server {
+
+  LaneRouter(
+    capnp::InterfaceSchema schema,
+    kj::Array<capnp::Capability::Client> lanes,
+    size_t bulkThreshold)
+    : lanes_{kj::mv(lanes)}
+    , bulkThreshold_{bulkThreshold} {
+    addRoutes(schema);
+  }
+
+  DispatchCallResult dispatchCall(
+      uint64_t interfaceId, uint16_t methodId,
+      capnp::CallContext<capnp::AnyPointer, capnp::AnyPointer> context) override {
+
+    auto params = context.getParams();
+    auto size = params.targetSize();
+    auto& lane = lanes_[route(interfaceId, methodId, size)];
+
+    auto req = lane.typelessRequest(interfaceId, methodId, size, {});
+    req.set(params);
+    context.releaseParams();
+    return { context.tailCall(kj::mv(req)), false };
+  }
+
+private:
+  void addRoutes(capnp::InterfaceSchema schema) {
+    auto interfaceId = schema.getProto().getId();
+    for (auto method: schema.getMethods()) {
+      for (auto annotation: method.getProto().getAnnotations()) {
+	if (annotation.getId() != LANE_ANNOTATION_ID) {
+	  continue;
+	}
+	auto lane = annotation.getValue().getUint8();
+	KJ_REQUIRE(lane < lanes_.size(), "No such lane",
+		   schema.getShortDisplayName(), method.getProto().getName(), lane);
+	auto& methods = routes_.findOrCreate(interfaceId, [interfaceId]() {
+	  return decltype(routes_)::Entry{interfaceId, {}};
+	});
+	methods.upsert(method.getOrdinal(), lane, [](auto& existing, auto replacement) {
+	  existing = replacement;
+	});
+      }
+    }
+    for (auto superclass: schema.getSuperclasses()) {
+      addRoutes(superclass);
+    }
+  }
+
+  size_t route(uint64_t interfaceId, uint16_t methodId, capnp::MessageSize size) {
+    KJ_IF_MAYBE(methods, routes_.find(interfaceId)) {
+      KJ_IF_MAYBE(lane, methods->find(methodId)) {
+	return *lane;
+      }
+    }
+    return size.wordCount * sizeof(capnp::word) > bulkThreshold_
+      ? lanes_.size() - 1
+      : 0;
+  }
+
+  kj::Array<capnp::Capability::Client> lanes_;
+  size_t bulkThreshold_;
+  kj::HashMap<uint64_t, kj::HashMap<uint16_t, uint8_t>> routes_;
+};
+
+}
+
+LanedClient::LanedClient(
+  kj::Array<kj::Own<AeronMessageStreamBase>> lanes,
+  size_t bulkThreshold)
+  : streams_{kj::mv(lanes)}
+  , clients_{KJ_MAP(stream, streams_) { return kj::heap<TwoPartyClient>(*stream); }}
+  , bulkThreshold_{bulkThreshold} {
+  KJ_REQUIRE(streams_.size() > 0);
+}
+
+capnp::Capability::Client LanedClient::bootstrap(capnp::InterfaceSchema schema) {
+  auto lanes = KJ_MAP(client, clients_) { return client->bootstrap(); };
+  return kj::heap<LaneRouter>(schema, kj::mv(lanes), bulkThreshold_);
+}
+
+}
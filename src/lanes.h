@@ -0,0 +1,42 @@
+#pragma once
+// Copyright (c) 2023 Vaci Koblizek.
+// Licensed under the Apache 2.0 license found in the LICENSE file or at:
+//     https://opensource.org/licenses/Apache-2.0
+
+// Calls routed over several lanes, each a session and RPC connection of
+// its own, so that a bulk transfer on one lane cannot hold up latency
+// sensitive calls on another.
+//
+// A method annotated with `$lane(n)` from aeron-rpc.capnp always uses lane
+// n. Otherwise calls whose parameters exceed the bulk threshold use the
+// last lane, and the rest lane 0. Calls are only delivered in order with
+// respect to others on the same lane, and capabilities returned by a call
+// belong to the lane it was made on.
+
+#include "aeron-rpc.h"
+
+#include <capnp/capability.h>
+#include <capnp/schema.h>
+
+namespace aeroncap {
+
+struct LanedClient {
+
+  explicit LanedClient(
+    kj::Array<kj::Own<AeronMessageStreamBase>> lanes,
+    size_t bulkThreshold = 64 * 1024);
+
+  template <typename T>
+  typename T::Client bootstrap() {
+    return bootstrap(capnp::Schema::from<T>()).template castAs<T>();
+  }
+
+  capnp::Capability::Client bootstrap(capnp::InterfaceSchema);
+
+private:
+  kj::Array<kj::Own<AeronMessageStreamBase>> streams_;
+  kj::Array<kj::Own<TwoPartyClient>> clients_;
+  size_t bulkThreshold_;
+};
+
+}
@@ -0,0 +1,121 @@
+// Copyright (c) 2023 Vaci Koblizek.
+// Licensed under the Apache 2.0 license found in the LICENSE file or at:
+//     https://opensource.org/licenses/Apache-2.0
+
+#include "loopback.h"
+#include "hello.capnp.h"
+
+#include <capnp/message.h>
+#include <capnp/rpc-twoparty.h>
+
+#include <kj/async-io.h>
+#include <kj/debug.h>
+#include <kj/main.h>
+
+#include <gtest/gtest.h>
+
+using namespace aeroncap;
+
+struct Loopback
+  : testing::Test {
+
+  kj::AsyncIoContext ioCtx_{kj::setupAsyncIo()};
+  kj::WaitScope& waitScope_{ioCtx_.waitScope};
+  kj::Timer& timer_{ioCtx_.provider->getTimer()};
+
+  decltype(idle::yield()) readIdler_{idle::yield()};
+  decltype(idle::yield()) writeIdler_{idle::yield()};
+};
+
+TEST_F(Loopback, Basic) {
+  LoopbackLog log;
+  LoopbackMessageStream ms{log.publication(), log.image(), readIdler_, writeIdler_};
+
+  capnp::MallocMessageBuilder mb;
+  auto data = mb.initRoot<capnp::Text>(16u);
+  memset(data.begin(), 'a', data.size());
+
+  ms.writeMessage(nullptr, mb.getSegmentsForOutput()).wait(waitScope_);
+  auto msg = ms.readMessage().wait(waitScope_);
+  EXPECT_EQ(msg->getRoot<capnp::Text>(), data);
+}
+
+TEST_F(Loopback, Fragmented) {
+  LoopbackLog log{64 * 1024, 256};
+  LoopbackMessageStream ms{log.publication(), log.image(), readIdler_, writeIdler_};
+
+  capnp::MallocMessageBuilder mb;
+  auto data = mb.initRoot<capnp::Data>(4000u);
+  for (auto ii = 0u; ii < data.size(); ++ii) {
+    data[ii] = ii;
+  }
+
+  // many times round the buffer, to pad at the end of it
+  for (auto ii = 0; ii < 64; ++ii) {
+    ms.writeMessage(nullptr, mb.getSegmentsForOutput()).wait(waitScope_);
+    auto msg = ms.readMessage().wait(waitScope_);
+    EXPECT_EQ(msg->getRoot<capnp::Data>(), data);
+  }
+}
+
+TEST_F(Loopback, BackPressure) {
+  LoopbackLog log{1024, 256};
+  auto pub = log.publication();
+  auto image = log.image();
+
+  capnp::MallocMessageBuilder mb;
+  mb.initRoot<capnp::Data>(100u);
+  auto segments = mb.getSegmentsForOutput();
+  auto byteSize = capnp::computeSerializedSizeInWords(segments) * sizeof(capnp::word);
+
+  auto count = 0;
+  while (_::tryClaim(pub, segments, byteSize)) {
+    ++count;
+  }
+  auto frameLength = (byteSize + ::aeron::DataFrameHeader::LENGTH + 31) & ~31;
+  EXPECT_EQ(count, 1024 / frameLength);
+
+  // reading a message makes room for one more
+  _::MessageAssembler assembler{capnp::ReaderOptions{}};
+  assembler.poll(image, 1);
+  EXPECT_TRUE(assembler.release() != nullptr);
+  EXPECT_TRUE(_::tryClaim(pub, segments, byteSize));
+  EXPECT_FALSE(_::tryClaim(pub, segments, byteSize));
+}
+
+struct HelloServer
+  : Hello::Server {
+
+  kj::Promise<void> greet(GreetContext ctx) {
+    ctx.getResults().setGreeting("Hello, world!"_kj);
+    return kj::READY_NOW;
+  }
+};
+
+TEST_F(Loopback, TwoParty) {
+  LoopbackLog logA, logB;
+  auto serverIdler = idle::yield();
+  LoopbackMessageStream msA{logA.publication(), logB.image(), readIdler_, writeIdler_};
+  LoopbackMessageStream msB{logB.publication(), logA.image(), serverIdler, serverIdler};
+
+  capnp::TwoPartyVatNetwork server{msB, capnp::rpc::twoparty::Side::SERVER};
+  auto rpcServer = capnp::makeRpcServer(server, kj::heap<HelloServer>());
+
+  capnp::TwoPartyVatNetwork client{msA, capnp::rpc::twoparty::Side::CLIENT};
+  auto rpcClient = capnp::makeRpcClient(client);
+
+  capnp::MallocMessageBuilder mb;
+  auto vatId = mb.getRoot<capnp::rpc::twoparty::VatId>();
+  vatId.setSide(capnp::rpc::twoparty::Side::SERVER);
+  auto cap = rpcClient.bootstrap(vatId).castAs<Hello>();
+  auto reply = cap.greetRequest().send().wait(waitScope_);
+  EXPECT_EQ(reply.getGreeting(), "Hello, world!"_kj);
+}
+
+int main(int argc, char* argv[]) {
+  kj::TopLevelProcessContext processCtx{argv[0]};
+  processCtx.increaseLoggingVerbosity();
+
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
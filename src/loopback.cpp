@@ -0,0 +1,286 @@
+// Copyright (c) 2023 Vaci Koblizek.
+// Licensed under the Apache 2.0 license found in the LICENSE file or at:
+//     https://opensource.org/licenses/Apache-2.0
+
+#include "loopback.h"
+
+namespace aeroncap {
+
+namespace {
+
+namespace frame = ::aeron::FrameDescriptor;
+namespace header = ::aeron::DataFrameHeader;
+
+constexpr int32_t align(int32_t length) {
+  return (length + frame::FRAME_ALIGNMENT - 1) & ~(frame::FRAME_ALIGNMENT - 1);
+}
+
+std::atomic<int32_t> nextSessionId{1};
+
+}
+
+LoopbackLog::LoopbackLog(uint32_t termLength, uint32_t mtu)
+  : words_{kj::heapArray<capnp::word>(termLength / sizeof(capnp::word))}
+  , buffer_{reinterpret_cast<uint8_t*>(words_.begin()), termLength}
+  , capacity_{static_cast<int32_t>(termLength)}
+  , mtu_{static_cast<int32_t>(mtu)}
+  , sessionId_{nextSessionId.fetch_add(1, std::memory_order_relaxed)} {
+
+  KJ_REQUIRE(termLength >= 2 * frame::FRAME_ALIGNMENT, termLength);
+  KJ_REQUIRE((termLength & (termLength - 1)) == 0, "Term length must be a power of two", termLength);
+  KJ_REQUIRE(mtu > header::LENGTH && mtu % frame::FRAME_ALIGNMENT == 0, mtu);
+  KJ_REQUIRE(mtu <= termLength, mtu, termLength);
+  buffer_.setMemory(0, capacity_, 0);
+}
+
+LoopbackPublication LoopbackLog::publication() {
+  return LoopbackPublication{*this};
+}
+
+LoopbackImage LoopbackLog::image() {
+  return LoopbackImage{*this};
+}
+
+int64_t LoopbackPublication::tryClaim(int32_t length, ::aeron::BufferClaim& claim) {
+  KJ_REQUIRE(length <= maxPayloadLength(), length);
+
+  if (auto err = checkCapacity(length)) {
+    return err;
+  }
+
+  auto position = log_.tail_.load(std::memory_order_relaxed);
+  auto frameLength = length + header::LENGTH;
+  auto offset = beginFrame(position, frameLength, frame::UNFRAGMENTED);
+  // committed by the claim, which writes the frame length
+  claim.wrap(log_.buffer_, offset, frameLength);
+  log_.tail_.store(position, std::memory_order_release);
+  return position;
+}
+
+int64_t LoopbackPublication::offer(
+    ::aeron::concurrent::AtomicBuffer const& src,
+    int32_t srcOffset,
+    int32_t length,
+    kj::FunctionParam<int64_t(::aeron::concurrent::AtomicBuffer&, int32_t, int32_t)>
+      reservedValueSupplier) {
+
+  KJ_REQUIRE(length <= maxMessageLength(), length);
+
+  if (auto err = checkCapacity(length)) {
+    return err;
+  }
+
+  auto& buffer = log_.buffer_;
+  auto position = log_.tail_.load(std::memory_order_relaxed);
+  auto maxPayload = maxPayloadLength();
+  auto remaining = length;
+
+  do {
+    auto payloadLength = std::min(remaining, maxPayload);
+    auto frameLength = payloadLength + header::LENGTH;
+
+    uint8_t flags = 0;
+    if (remaining == length) {
+      flags |= frame::BEGIN_FRAG;
+    }
+    if (remaining == payloadLength) {
+      flags |= frame::END_FRAG;
+    }
+
+    auto offset = beginFrame(position, frameLength, flags);
+    buffer.putBytes(
+      offset + header::LENGTH, src, srcOffset + length - remaining, payloadLength);
+    buffer.putInt64(
+      offset + header::RESERVED_VALUE_FIELD_OFFSET,
+      reservedValueSupplier(buffer, offset, frameLength));
+    buffer.putInt32Ordered(offset, frameLength);
+
+    remaining -= payloadLength;
+  } while (remaining > 0);
+
+  log_.tail_.store(position, std::memory_order_release);
+  return position;
+}
+
+int64_t LoopbackPublication::checkCapacity(int32_t length) const {
+  if (isClosed()) {
+    return ::aeron::PUBLICATION_CLOSED;
+  }
+  if (log_.imageClosed_.load(std::memory_order_acquire)) {
+    return ::aeron::NOT_CONNECTED;
+  }
+
+  // walk the frames as beginFrame would, padding included
+  auto maxPayload = maxPayloadLength();
+  auto position = log_.tail_.load(std::memory_order_relaxed);
+  auto remaining = length;
+  do {
+    auto payloadLength = std::min(remaining, maxPayload);
+    auto alignedLength = align(payloadLength + header::LENGTH);
+    auto available = log_.capacity_ - log_.offsetOf(position);
+    if (alignedLength > available) {
+      position += available;
+    }
+    position += alignedLength;
+    remaining -= payloadLength;
+  } while (remaining > 0);
+
+  auto head = log_.head_.load(std::memory_order_acquire);
+  if (position - head > log_.capacity_) {
+    return ::aeron::BACK_PRESSURED;
+  }
+  return 0;
+}
+
+int32_t LoopbackPublication::beginFrame(
+    int64_t& position, int32_t frameLength, uint8_t flags) {
+
+  auto& buffer = log_.buffer_;
+  auto alignedLength = align(frameLength);
+  auto offset = log_.offsetOf(position);
+  auto available = log_.capacity_ - offset;
+
+  if (alignedLength > available) {
+    buffer.putUInt16(offset + header::TYPE_FIELD_OFFSET, header::HDR_TYPE_PAD);
+    buffer.putInt32Ordered(offset, available);
+    position += available;
+    offset = 0;
+  }
+
+  buffer.putUInt8(offset + header::VERSION_FIELD_OFFSET, header::CURRENT_VERSION);
+  buffer.putUInt8(offset + header::FLAGS_FIELD_OFFSET, flags);
+  buffer.putUInt16(offset + header::TYPE_FIELD_OFFSET, header::HDR_TYPE_DATA);
+  buffer.putInt32(offset + header::TERM_OFFSET_FIELD_OFFSET, offset);
+  buffer.putInt32(offset + header::SESSION_ID_FIELD_OFFSET, log_.sessionId_);
+  buffer.putInt64(offset + header::RESERVED_VALUE_FIELD_OFFSET, 0);
+
+  position += alignedLength;
+  return offset;
+}
+
+int64_t LoopbackPublication::position() const {
+  return log_.tail_.load(std::memory_order_acquire);
+}
+
+int32_t LoopbackPublication::maxPayloadLength() const {
+  return log_.mtu_ - header::LENGTH;
+}
+
+int32_t LoopbackPublication::maxMessageLength() const {
+  // as for a term, so that a message can never fill the whole buffer
+  return log_.capacity_ / 8;
+}
+
+bool LoopbackPublication::isClosed() const {
+  return log_.publicationClosed_.load(std::memory_order_acquire);
+}
+
+void LoopbackPublication::close() {
+  log_.publicationClosed_.store(true, std::memory_order_release);
+}
+
+uint8_t LoopbackImage::Header::flags() const {
+  return buffer_.getUInt8(offset_ + header::FLAGS_FIELD_OFFSET);
+}
+
+int64_t LoopbackImage::Header::reservedValue() const {
+  return buffer_.getInt64(offset_ + header::RESERVED_VALUE_FIELD_OFFSET);
+}
+
+int32_t LoopbackImage::Header::sessionId() const {
+  return buffer_.getInt32(offset_ + header::SESSION_ID_FIELD_OFFSET);
+}
+
+kj::Maybe<int32_t> LoopbackImage::nextFrame() {
+  auto& buffer = log_.buffer_;
+  while (true) {
+    auto offset = log_.offsetOf(log_.head_.load(std::memory_order_relaxed));
+    auto frameLength = buffer.getInt32Volatile(offset);
+    if (frameLength <= 0) {
+      return nullptr;
+    }
+    if (buffer.getUInt16(offset + header::TYPE_FIELD_OFFSET) != header::HDR_TYPE_PAD) {
+      return offset;
+    }
+    consume(offset);
+  }
+}
+
+void LoopbackImage::consume(int32_t offset) {
+  auto alignedLength = align(log_.buffer_.getInt32(offset));
+  log_.buffer_.setMemory(offset, alignedLength, 0);
+  log_.head_.fetch_add(alignedLength, std::memory_order_release);
+}
+
+int64_t LoopbackImage::position() const {
+  return log_.head_.load(std::memory_order_acquire);
+}
+
+bool LoopbackImage::isEndOfStream() const {
+  return log_.publicationClosed_.load(std::memory_order_acquire)
+    && position() == log_.tail_.load(std::memory_order_acquire);
+}
+
+bool LoopbackImage::isClosed() const {
+  return log_.imageClosed_.load(std::memory_order_acquire);
+}
+
+void LoopbackImage::close() {
+  log_.imageClosed_.store(true, std::memory_order_release);
+}
+
+LoopbackMessageStream::LoopbackMessageStream(
+  LoopbackPublication pub,
+  LoopbackImage image,
+  Idler& readIdler,
+  Idler& writeIdler,
+  capnp::ReaderOptions options)
+  : pub_{kj::mv(pub)}
+  , image_{kj::mv(image)}
+  , readIdler_{readIdler}
+  , writeIdler_{writeIdler}
+  , options_{options} {
+}
+
+LoopbackMessageStream::~LoopbackMessageStream() {
+  pub_.close();
+  image_.close();
+}
+
+kj::Promise<kj::Maybe<capnp::MessageReaderAndFds>> LoopbackMessageStream::tryReadMessage(
+    kj::ArrayPtr<kj::AutoCloseFd> fdSpace,
+    capnp::ReaderOptions options,
+    kj::ArrayPtr<capnp::word> scratchSpace) {
+
+  auto maybeReader = co_await _::tryReadMessage(readIdler_, image_, options, scratchSpace);
+  KJ_IF_MAYBE(reader, maybeReader) {
+    co_return capnp::MessageReaderAndFds{kj::mv(*reader), nullptr};
+  }
+  co_return nullptr;
+}
+
+kj::Promise<void> LoopbackMessageStream::writeMessages(
+    kj::ArrayPtr<kj::ArrayPtr<kj::ArrayPtr<capnp::word const> const>> messages) {
+
+  for (auto msg: messages) {
+    co_await writeMessage(nullptr, msg);
+  }
+}
+
+kj::Promise<void> LoopbackMessageStream::writeMessage(
+    kj::ArrayPtr<int const> fds,
+    kj::ArrayPtr<kj::ArrayPtr<capnp::word const> const> segments) {
+
+  return _::writeMessage(writeIdler_, pub_, segments);
+}
+
+kj::Promise<void> LoopbackMessageStream::end() {
+  pub_.close();
+  return kj::READY_NOW;
+}
+
+kj::Maybe<int> LoopbackMessageStream::getSendBufferSize() {
+  return pub_.termBufferLength();
+}
+
+}
@@ -0,0 +1,193 @@
+#pragma once
+// Copyright (c) 2023 Vaci Koblizek.
+// Licensed under the Apache 2.0 license found in the LICENSE file or at:
+//     https://opensource.org/licenses/Apache-2.0
+
+// In-process stand-ins for an Aeron publication and image, so that the
+// capnp layer can be tested and benchmarked without a media driver.
+//
+// Frames are laid out exactly as in an Aeron term, so the same claim,
+// offer, fragmentation and polling paths are exercised, and the publication
+// is back pressured once the image falls a whole buffer behind.
+
+#include "serialize.h"
+
+#include <Aeron.h>
+#include <atomic>
+#include <kj/function.h>
+
+namespace aeroncap {
+
+struct LoopbackPublication;
+struct LoopbackImage;
+
+// A single producer, single consumer ring of data frames. A frame never
+// wraps around the end of the buffer; the space left over is padded
+// instead, as at the end of an Aeron term.
+struct LoopbackLog {
+
+  explicit LoopbackLog(uint32_t termLength = 64 * 1024, uint32_t mtu = 1408);
+
+  LoopbackPublication publication();
+  LoopbackImage image();
+
+private:
+  friend struct LoopbackPublication;
+  friend struct LoopbackImage;
+
+  int32_t offsetOf(int64_t position) const {
+    return static_cast<int32_t>(position & (capacity_ - 1));
+  }
+
+  kj::Array<capnp::word> words_;
+  ::aeron::concurrent::AtomicBuffer buffer_;
+  int32_t capacity_;
+  int32_t mtu_;
+  int32_t sessionId_;
+
+  alignas(64) std::atomic<int64_t> head_{0};
+  alignas(64) std::atomic<int64_t> tail_{0};
+  std::atomic<bool> publicationClosed_{false};
+  std::atomic<bool> imageClosed_{false};
+};
+
+// Follows the interface of `::aeron::ExclusivePublication`.
+struct LoopbackPublication {
+
+  explicit LoopbackPublication(LoopbackLog& log)
+    : log_{log} {
+  }
+
+  int64_t tryClaim(int32_t length, ::aeron::BufferClaim&);
+
+  int64_t offer(
+    ::aeron::concurrent::AtomicBuffer const&,
+    int32_t offset,
+    int32_t length,
+    kj::FunctionParam<int64_t(::aeron::concurrent::AtomicBuffer&, int32_t, int32_t)>
+      reservedValueSupplier);
+
+  int64_t position() const;
+  int32_t sessionId() const { return log_.sessionId_; }
+  int32_t termBufferLength() const { return log_.capacity_; }
+  int32_t maxPayloadLength() const;
+  int32_t maxMessageLength() const;
+  bool isClosed() const;
+  void close();
+
+private:
+  // Returns zero if there is room for a message of `length` bytes,
+  // fragmented as need be, and otherwise the reason why not.
+  int64_t checkCapacity(int32_t length) const;
+
+  // Pads out the end of the buffer if need be, and writes the header of a
+  // frame other than its length, which commits it. Returns its offset.
+  int32_t beginFrame(int64_t& position, int32_t frameLength, uint8_t flags);
+
+  LoopbackLog& log_;
+};
+
+// Follows the interface of `::aeron::Image`.
+struct LoopbackImage {
+
+  struct Header {
+    uint8_t flags() const;
+    int64_t reservedValue() const;
+    int32_t sessionId() const;
+
+    ::aeron::concurrent::AtomicBuffer& buffer_;
+    int32_t offset_;
+  };
+
+  explicit LoopbackImage(LoopbackLog& log)
+    : log_{log} {
+  }
+
+  template <typename Handler>
+  int controlledPoll(Handler&& handler, int fragmentLimit) {
+    using Action = ::aeron::ControlledPollAction;
+    constexpr auto HEADER_LENGTH = ::aeron::DataFrameHeader::LENGTH;
+
+    int fragmentsRead = 0;
+    while (fragmentsRead < fragmentLimit) {
+      auto maybeOffset = nextFrame();
+      KJ_IF_MAYBE(offset, maybeOffset) {
+	auto& buffer = log_.buffer_;
+	auto frameLength = buffer.getInt32(*offset);
+	Header header{buffer, *offset};
+	auto action = handler(buffer, *offset + HEADER_LENGTH, frameLength - HEADER_LENGTH, header);
+	if (action == Action::ABORT) {
+	  break;
+	}
+	consume(*offset);
+	++fragmentsRead;
+	if (action == Action::BREAK) {
+	  break;
+	}
+      }
+      else {
+	break;
+      }
+    }
+    return fragmentsRead;
+  }
+
+  int64_t position() const;
+  int32_t sessionId() const { return log_.sessionId_; }
+  bool isEndOfStream() const;
+  bool isClosed() const;
+  void close();
+
+private:
+  // Skips any padding, and returns the offset of the next committed frame.
+  kj::Maybe<int32_t> nextFrame();
+
+  // Clears the frame at `offset` so that its space can be reused.
+  void consume(int32_t offset);
+
+  LoopbackLog& log_;
+};
+
+// A `capnp::MessageStream` over a pair of loopback logs, one in each
+// direction, for exercising the same read and write paths as
+// `AeronMessageStream`.
+struct LoopbackMessageStream final
+  : capnp::MessageStream {
+
+  LoopbackMessageStream(
+    LoopbackPublication,
+    LoopbackImage,
+    Idler& readIdler,
+    Idler& writeIdler,
+    capnp::ReaderOptions = {}
+  );
+
+  ~LoopbackMessageStream();
+
+  capnp::ReaderOptions getReaderOptions() const { return options_; }
+
+  kj::Promise<kj::Maybe<capnp::MessageReaderAndFds>> tryReadMessage(
+    kj::ArrayPtr<kj::AutoCloseFd>,
+    capnp::ReaderOptions = capnp::ReaderOptions{},
+    kj::ArrayPtr<capnp::word> scratchSpace = nullptr) override;
+
+  kj::Promise<void> writeMessage(
+    kj::ArrayPtr<int const>,
+    kj::ArrayPtr<kj::ArrayPtr<capnp::word const> const>) override;
+
+  kj::Promise<void> writeMessages(
+    kj::ArrayPtr<kj::ArrayPtr<kj::ArrayPtr<capnp::word const> const>>) override;
+
+  kj::Promise<void> end() override;
+
+  kj::Maybe<int> getSendBufferSize() override;
+
+private:
+  LoopbackPublication pub_;
+  LoopbackImage image_;
+  Idler& readIdler_;
+  Idler& writeIdler_;
+  capnp::ReaderOptions options_;
+};
+
+}
@@ -0,0 +1,360 @@
+// Copyright (c) 2023 Vaci Koblizek.
+// Licensed under the Apache 2.0 license found in the LICENSE file or at:
+//     https://opensource.org/licenses/Apache-2.0
+
+#include "mux.h"
+#include "common.h"
+
+namespace aeroncap {
+
+namespace {
+
+// The low 32 bits of the reserved value identify the logical stream
+constexpr int64_t CLOSE_FLAG = int64_t{1} << 32;
+
+// Logical streams opened by the server side are numbered from here, so as
+// not to collide with those opened by the client.
+constexpr uint32_t SERVER_CHANNEL_ID = 0x80000000;
+
+}
+
+// Messages received for a logical stream, waiting to be read on the thread
+// that owns it.
+struct MultiplexedSession::Channel
+  : kj::AtomicRefcounted {
+
+  struct Inbox {
+    Queue<kj::Own<capnp::MessageReader>> messages;
+    kj::Maybe<kj::Own<kj::CrossThreadPromiseFulfiller<void>>> waiter;
+    bool closed{false};
+  };
+
+  void push(kj::Own<capnp::MessageReader> reader) const {
+    auto inbox = inbox_.lockExclusive();
+    inbox->messages.push(kj::mv(reader));
+    wake(*inbox);
+  }
+
+  void close() const {
+    auto inbox = inbox_.lockExclusive();
+    inbox->closed = true;
+    wake(*inbox);
+  }
+
+  static void wake(Inbox& inbox) {
+    KJ_IF_MAYBE(waiter, inbox.waiter) {
+      (*waiter)->fulfill();
+      inbox.waiter = nullptr;
+    }
+  }
+
+  kj::MutexGuarded<Inbox> inbox_;
+};
+
+struct MultiplexedSession::LogicalStream final
+  : capnp::MessageStream {
+
+  LogicalStream(
+    MultiplexedSession& session,
+    uint32_t id,
+    kj::Own<const Channel> channel,
+    kj::Own<Idler> writeIdler)
+    : session_{session}
+    , id_{id}
+    , channel_{kj::mv(channel)}
+    , writeIdler_{kj::mv(writeIdler)} {
+  }
+
+  ~LogicalStream() {
+    {
+      auto channels = session_.channels_.lockExclusive();
+      channels->erase(id_);
+    }
+    if (!ended_) {
+      // best effort; nobody is left to wait for back pressure
+      KJ_IF_MAYBE(exc, kj::runCatchingExceptions([this] {
+	session_.tryClaim(id_ | CLOSE_FLAG, emptyMessage(), sizeof(capnp::word));
+      })) {
+	KJ_LOG(WARNING, "Failed to close logical stream", id_, *exc);
+      }
+    }
+  }
+
+  kj::Promise<kj::Maybe<capnp::MessageReaderAndFds>> tryReadMessage(
+      kj::ArrayPtr<kj::AutoCloseFd>,
+      capnp::ReaderOptions,
+      kj::ArrayPtr<capnp::word>) override {
+
+    while (true) {
+      kj::Maybe<kj::Promise<void>> ready;
+      {
+	auto inbox = channel_->inbox_.lockExclusive();
+	if (!inbox->messages.empty()) {
+	  co_return capnp::MessageReaderAndFds{inbox->messages.pop(), nullptr};
+	}
+	if (inbox->closed) {
+	  co_return nullptr;
+	}
+	auto paf = kj::newPromiseAndCrossThreadFulfiller<void>();
+	inbox->waiter = kj::mv(paf.fulfiller);
+	ready = kj::mv(paf.promise);
+      }
+      KJ_IF_MAYBE(promise, ready) {
+	co_await kj::mv(*promise);
+      }
+    }
+  }
+
+  kj::Promise<void> writeMessage(
+      kj::ArrayPtr<int const>,
+      kj::ArrayPtr<kj::ArrayPtr<capnp::word const> const> segments) override {
+    return write(id_, segments);
+  }
+
+  kj::Promise<void> writeMessages(
+      kj::ArrayPtr<kj::ArrayPtr<kj::ArrayPtr<capnp::word const> const>> messages) override {
+    for (auto msg: messages) {
+      co_await write(id_, msg);
+    }
+  }
+
+  kj::Promise<void> end() override {
+    ended_ = true;
+    return write(id_ | CLOSE_FLAG, emptyMessage());
+  }
+
+  kj::Maybe<int> getSendBufferSize() override {
+    return nullptr;
+  }
+
+  kj::Promise<void> write(
+      int64_t reservedValue,
+      kj::ArrayPtr<kj::ArrayPtr<capnp::word const> const> segments) {
+
+    auto byteSize = capnp::computeSerializedSizeInWords(segments) * sizeof(capnp::word);
+    auto& idler = *writeIdler_;
+
+    if (byteSize <= session_.maxPayloadLength()) {
+      if (session_.tryClaim(reservedValue, segments, byteSize)) {
+	co_return;
+      }
+      do {
+	co_await idler.idle();
+      } while (!session_.tryClaim(reservedValue, segments, byteSize));
+    }
+    else {
+      auto words = capnp::messageToFlatArray(segments);
+      if (session_.tryOffer(reservedValue, words.asBytes())) {
+	co_return;
+      }
+      do {
+	co_await idler.idle();
+      } while (!session_.tryOffer(reservedValue, words.asBytes()));
+    }
+    idler.reset();
+  }
+
+  static kj::ArrayPtr<kj::ArrayPtr<capnp::word const> const> emptyMessage() {
+    static const kj::ArrayPtr<capnp::word const> segments[1] = { nullptr };
+    return segments;
+  }
+
+  MultiplexedSession& session_;
+  uint32_t id_;
+  kj::Own<const Channel> channel_;
+  kj::Own<Idler> writeIdler_;
+  bool ended_{false};
+};
+
+MultiplexedSession::MultiplexedSession(
+  kj::Timer& timer,
+  std::shared_ptr<::aeron::Publication> pub,
+  ::aeron::Image image,
+  capnp::ReaderOptions options)
+  : transport_{kj::mv(pub)}
+  , image_{kj::mv(image)}
+  , options_{options}
+  , readIdler_{kj::heap(idle::periodic(timer, kj::NANOSECONDS))}
+  , timer_{timer}
+  , nextChannelId_{1}
+  , demux_{demultiplex(*readIdler_).eagerlyEvaluate(
+      [this](kj::Exception&& exc) {
+	KJ_LOG(ERROR, "Demultiplexing failed", exc);
+	disconnect();
+      })} {
+}
+
+MultiplexedSession::MultiplexedSession(
+  kj::Timer& timer,
+  kj::Own<AeronMessageStreamBase> stream,
+  kj::Function<void(kj::Own<capnp::MessageStream>)> onAccept)
+  : transport_{kj::mv(stream)}
+  , image_{serverStream().getImage()}
+  , options_{serverStream().getReaderOptions()}
+  , onAccept_{kj::mv(onAccept)}
+  , readIdler_{kj::Own<Idler>(&serverStream().getReadIdler(), kj::NullDisposer::instance)}
+  , timer_{timer}
+  , nextChannelId_{SERVER_CHANNEL_ID}
+  , demux_{demultiplex(*readIdler_).eagerlyEvaluate(
+      [this](kj::Exception&& exc) {
+	KJ_LOG(ERROR, "Demultiplexing failed", exc);
+	disconnect();
+      })} {
+  // a client that times out never ends its stream, so demultiplexing
+  // alone would never notice it go
+  disconnectWhen(serverStream().whenDisconnected());
+}
+
+MultiplexedSession::~MultiplexedSession() {
+  disconnect();
+  image_.close();
+}
+
+kj::Own<capnp::MessageStream> MultiplexedSession::open(kj::Timer& timer) {
+  auto id = nextChannelId_.fetch_add(1, std::memory_order_relaxed);
+  return newStream(id, kj::heap(idle::backoff(timer)));
+}
+
+kj::Own<MultiplexedSession::LogicalStream> MultiplexedSession::newStream(
+    uint32_t id, kj::Own<Idler> writeIdler) {
+  auto channel = kj::atomicRefcounted<Channel>();
+  auto stream = kj::heap<LogicalStream>(*this, id, kj::atomicAddRef(*channel), kj::mv(writeIdler));
+  {
+    auto channels = channels_.lockExclusive();
+    channels->insert(id, kj::mv(channel));
+  }
+  return stream;
+}
+
+kj::Promise<void> MultiplexedSession::demultiplex(Idler& idler) {
+  _::MessageAssembler assembler{options_};
+  int64_t reservedValue{0};
+
+  auto handler = [&](auto& buffer, auto offset, auto length, auto& header) {
+    auto flags = header.flags();
+    if (flags & ::aeron::FrameDescriptor::BEGIN_FRAG) {
+      reservedValue = header.reservedValue();
+    }
+    return assembler.onFragment(buffer.buffer() + offset, length, flags);
+  };
+
+  while (true) {
+    auto fragmentsRead = image_.controlledPoll(handler, 16);
+    KJ_IF_MAYBE(reader, assembler.release()) {
+      dispatch(reservedValue, kj::mv(*reader));
+      idler.reset();
+      continue;
+    }
+
+    if (KJ_UNLIKELY(image_.isEndOfStream())) {
+      break;
+    }
+
+    if (fragmentsRead) {
+      idler.reset();
+    }
+
+    co_await idler.idle();
+  }
+
+  disconnect();
+}
+
+void MultiplexedSession::dispatch(
+    int64_t reservedValue, kj::Own<capnp::MessageReader> reader) {
+
+  auto id = static_cast<uint32_t>(reservedValue);
+  auto close = (reservedValue & CLOSE_FLAG) != 0;
+
+  kj::Maybe<kj::Own<const Channel>> channel;
+  {
+    auto channels = channels_.lockExclusive();
+    KJ_IF_MAYBE(c, channels->find(id)) {
+      channel = kj::atomicAddRef(**c);
+      if (close) {
+	channels->erase(id);
+      }
+    }
+  }
+
+  KJ_IF_MAYBE(c, channel) {
+    if (close) {
+      (*c)->close();
+    }
+    else {
+      (*c)->push(kj::mv(reader));
+    }
+    return;
+  }
+
+  if (close) {
+    return;
+  }
+
+  KJ_IF_MAYBE(onAccept, onAccept_) {
+    auto logical = newStream(id, kj::heap(idle::backoff(timer_)));
+    logical->channel_->push(kj::mv(reader));
+    (*onAccept)(kj::mv(logical));
+  }
+  else {
+    KJ_LOG(WARNING, "Message for unknown logical stream", id);
+  }
+}
+
+void MultiplexedSession::disconnectWhen(kj::Promise<void> disconnected) {
+  watcher_ = disconnected.catch_([this](kj::Exception&& exc) {
+    KJ_LOG(INFO, "Multiplexed session disconnected", exc);
+    disconnect();
+  }).eagerlyEvaluate(nullptr);
+}
+
+void MultiplexedSession::disconnect() {
+  auto channels = channels_.lockExclusive();
+  for (auto& entry: *channels) {
+    entry.value->close();
+  }
+  channels->clear();
+  disconnect_.fulfiller->fulfill();
+}
+
+bool MultiplexedSession::tryClaim(
+    int64_t reservedValue,
+    kj::ArrayPtr<kj::ArrayPtr<capnp::word const> const> segments,
+    uint64_t byteSize) {
+  KJ_SWITCH_ONEOF(transport_) {
+    KJ_CASE_ONEOF(pub, std::shared_ptr<::aeron::Publication>) {
+      return _::tryClaim(*pub, segments, byteSize, reservedValue);
+    }
+    KJ_CASE_ONEOF(stream, kj::Own<AeronMessageStreamBase>) {
+      return _::tryClaim(stream->getPublication(), segments, byteSize, reservedValue);
+    }
+  }
+  KJ_UNREACHABLE;
+}
+
+bool MultiplexedSession::tryOffer(
+    int64_t reservedValue, kj::ArrayPtr<capnp::byte> bytes) {
+  KJ_SWITCH_ONEOF(transport_) {
+    KJ_CASE_ONEOF(pub, std::shared_ptr<::aeron::Publication>) {
+      return _::tryOffer(*pub, bytes, reservedValue);
+    }
+    KJ_CASE_ONEOF(stream, kj::Own<AeronMessageStreamBase>) {
+      return _::tryOffer(stream->getPublication(), bytes, reservedValue);
+    }
+  }
+  KJ_UNREACHABLE;
+}
+
+size_t MultiplexedSession::maxPayloadLength() {
+  KJ_SWITCH_ONEOF(transport_) {
+    KJ_CASE_ONEOF(pub, std::shared_ptr<::aeron::Publication>) {
+      return pub->maxPayloadLength();
+    }
+    KJ_CASE_ONEOF(stream, kj::Own<AeronMessageStreamBase>) {
+      return stream->getPublication().maxPayloadLength();
+    }
+  }
+  KJ_UNREACHABLE;
+}
+
+}
@@ -0,0 +1,102 @@
+#pragma once
+// Copyright (c) 2023 Vaci Koblizek.
+// Licensed under the Apache 2.0 license found in the LICENSE file or at:
+//     https://opensource.org/licenses/Apache-2.0
+
+// Many logical capnp message streams multiplexed over a single Aeron
+// session, so that several threads can each run their own RpcSystem over
+// one connection. Each frame carries the id of its logical stream in the
+// header's reserved value.
+//
+// On the client, the session wraps a concurrent `::aeron::Publication`:
+// every thread writes straight into it, while the thread that created the
+// session polls the image and hands replies to the event loop of the thread
+// that opened the logical stream. On the server, the session wraps an
+// accepted `AeronMessageStreamBase` and accepts each new logical stream as it
+// appears.
+
+#include "serialize.h"
+
+#include <Aeron.h>
+#include <atomic>
+#include <capnp/serialize-async.h>
+#include <kj/function.h>
+#include <kj/map.h>
+#include <kj/mutex.h>
+#include <kj/one-of.h>
+#include <kj/refcount.h>
+#include <kj/timer.h>
+
+namespace aeroncap {
+
+struct MultiplexedSession {
+
+  // Client side.
+  MultiplexedSession(
+    kj::Timer&,
+    std::shared_ptr<::aeron::Publication>,
+    ::aeron::Image,
+    capnp::ReaderOptions = {});
+
+  // Server side; logical streams opened by the peer are passed to
+  // `onAccept`, each writing with its own idler on `timer`, so that one
+  // stream backing off holds up none of the others.
+  MultiplexedSession(
+    kj::Timer& timer,
+    kj::Own<AeronMessageStreamBase>,
+    kj::Function<void(kj::Own<capnp::MessageStream>)> onAccept);
+
+  ~MultiplexedSession();
+
+  // Opens a new logical stream bound to the calling thread's event loop.
+  // Logical streams must not outlive the session. Thread-safe.
+  kj::Own<capnp::MessageStream> open(kj::Timer&);
+
+  // Resolves when the peer goes away.
+  kj::Promise<void> onDisconnect() { return disconnected_.addBranch(); }
+
+  // Closes every logical stream as soon as `disconnected` rejects,
+  // typically when the image becomes unavailable.
+  void disconnectWhen(kj::Promise<void> disconnected);
+
+  capnp::ReaderOptions getReaderOptions() const { return options_; }
+
+private:
+  struct Channel;
+  struct LogicalStream;
+
+  kj::Promise<void> demultiplex(Idler&);
+  void dispatch(int64_t reservedValue, kj::Own<capnp::MessageReader>);
+  void disconnect();
+  kj::Own<LogicalStream> newStream(uint32_t id, kj::Own<Idler> writeIdler);
+
+  bool tryClaim(
+    int64_t reservedValue,
+    kj::ArrayPtr<kj::ArrayPtr<capnp::word const> const>,
+    uint64_t byteSize);
+  bool tryOffer(int64_t reservedValue, kj::ArrayPtr<capnp::byte>);
+  size_t maxPayloadLength();
+
+  AeronMessageStreamBase& serverStream() {
+    return *transport_.get<kj::Own<AeronMessageStreamBase>>();
+  }
+
+  kj::OneOf<
+    std::shared_ptr<::aeron::Publication>,
+    kj::Own<AeronMessageStreamBase>> transport_;
+  ::aeron::Image image_;
+  capnp::ReaderOptions options_;
+  kj::Maybe<kj::Function<void(kj::Own<capnp::MessageStream>)>> onAccept_;
+  kj::Own<Idler> readIdler_;
+  kj::Timer& timer_;
+
+  kj::MutexGuarded<kj::HashMap<uint32_t, kj::Own<const Channel>>> channels_;
+  std::atomic<uint32_t> nextChannelId_;
+
+  kj::PromiseFulfillerPair<void> disconnect_{kj::newPromiseAndFulfiller<void>()};
+  kj::ForkedPromise<void> disconnected_{disconnect_.promise.fork()};
+  kj::Promise<void> demux_;
+  kj::Promise<void> watcher_{kj::NEVER_DONE};
+};
+
+}
@@ -0,0 +1,177 @@
+// Copyright (c) 2023 Vaci Koblizek.
+// Licensed under the Apache 2.0 license found in the LICENSE file or at:
+//     https://opensource.org/licenses/Apache-2.0
+
+#include "pool.h"
+
+#include <kj/refcount.h>
+
+namespace aeroncap {
+
+// Kept alive by the calls outstanding on it, so that it can be dropped from
+// the pool as soon as it fails.
+struct ConnectionPool::Connection
+  : kj::Refcounted {
+
+  explicit Connection(kj::Own<AeronMessageStreamBase> stream)
+    : stream_{kj::mv(stream)}
+    , client_{*stream_}
+    , cap_{client_.bootstrap()} {
+  }
+
+  kj::Own<AeronMessageStreamBase> stream_;
+  TwoPartyClient client_;
+  capnp::Capability::Client cap_;
+  uint32_t outstanding_{0};
+};
+
+struct ConnectionPool::Balancer final
+  : capnp::Capability::Server {
+
+  explicit Balancer(ConnectionPool& pool)
+    : pool_{pool} {
+  }
+
+  DispatchCallResult dispatchCall(
+      uint64_t interfaceId, uint16_t methodId,
+      capnp::CallContext<capnp::AnyPointer, capnp::AnyPointer> context) override {
+
+    KJ_IF_MAYBE(connection, pool_.pick()) {
+      return { forward(*connection, interfaceId, methodId, context), false };
+    }
+
+    // nothing up yet, so wait for the first
+    auto promise = pool_.onConnected().then(
+      [this, interfaceId, methodId, context]() mutable {
+	auto& connection = KJ_REQUIRE_NONNULL(pool_.pick(), "No connection available");
+	return forward(connection, interfaceId, methodId, context);
+      });
+    return { kj::mv(promise), false };
+  }
+
+private:
+  static kj::Promise<void> forward(
+      Connection& connection, uint64_t interfaceId, uint16_t methodId,
+      capnp::CallContext<capnp::AnyPointer, capnp::AnyPointer> context) {
+
+    auto params = context.getParams();
+    auto req = connection.cap_.typelessRequest(interfaceId, methodId, params.targetSize(), {});
+    req.set(params);
+    context.releaseParams();
+
+    ++connection.outstanding_;
+    auto done = kj::defer([&connection]() {
+      --connection.outstanding_;
+    });
+    return context.tailCall(kj::mv(req)).attach(kj::mv(done), kj::addRef(connection));
+  }
+
+  ConnectionPool& pool_;
+};
+
+ConnectionPool::ConnectionPool(
+  kj::Timer& timer,
+  Connector& connector,
+  kj::ArrayPtr<PoolTarget const> targets,
+  size_t connectionsPerTarget,
+  kj::Duration retryDelay,
+  kj::Duration connectTimeout)
+  : timer_{timer}
+  , connector_{connector}
+  , targets_{targets}
+  , retryDelay_{retryDelay}
+  , connectTimeout_{connectTimeout}
+  , slots_{kj::heapArray<kj::Maybe<kj::Own<Connection>>>(targets.size() * connectionsPerTarget)}
+  , random_{reinterpret_cast<uintptr_t>(this) | 1} {
+
+  KJ_REQUIRE(slots_.size() > 0, "No connections to pool");
+
+  auto tasks = kj::heapArrayBuilder<kj::Promise<void>>(slots_.size());
+  for (auto ii = 0u; ii < slots_.size(); ++ii) {
+    tasks.add(maintain(ii));
+  }
+  tasks_ = tasks.finish();
+}
+
+ConnectionPool::~ConnectionPool() {
+}
+
+capnp::Capability::Client ConnectionPool::bootstrap() {
+  return kj::heap<Balancer>(*this);
+}
+
+size_t ConnectionPool::connected() const {
+  size_t count = 0;
+  for (auto& slot: slots_) {
+    if (slot != nullptr) {
+      ++count;
+    }
+  }
+  return count;
+}
+
+kj::Promise<void> ConnectionPool::onConnected() {
+  if (connected()) {
+    return kj::READY_NOW;
+  }
+  auto paf = kj::newPromiseAndFulfiller<void>();
+  waiters_.add(kj::mv(paf.fulfiller));
+  return kj::mv(paf.promise);
+}
+
+kj::Promise<void> ConnectionPool::maintain(size_t slot) {
+  auto& target = targets_[slot % targets_.size()];
+  while (true) {
+    try {
+      auto stream = co_await timer_.timeoutAfter(
+	connectTimeout_, connector_.connect(target.channel, target.streamId));
+      auto connection = kj::refcounted<Connection>(kj::mv(stream));
+      auto disconnected = connection->client_.onDisconnect();
+      slots_[slot] = kj::mv(connection);
+
+      for (auto& waiter: waiters_) {
+	waiter->fulfill();
+      }
+      waiters_.clear();
+
+      co_await disconnected;
+      KJ_LOG(WARNING, "Pooled connection lost", target.channel, target.streamId);
+    }
+    catch (...) {
+      KJ_LOG(WARNING, "Pooled connection failed", target.channel, target.streamId,
+	     kj::getCaughtExceptionAsKj());
+    }
+    slots_[slot] = nullptr;
+    co_await timer_.afterDelay(retryDelay_);
+  }
+}
+
+kj::Maybe<ConnectionPool::Connection&> ConnectionPool::pick() {
+  auto size = slots_.size();
+
+  // xorshift, as the choice needn't be unpredictable, only spread out
+  auto next = [this, size]() {
+    random_ ^= random_ << 13;
+    random_ ^= random_ >> 7;
+    random_ ^= random_ << 17;
+    return random_ % size;
+  };
+
+  // the first connection up, starting from the given slot
+  auto probe = [this, size](size_t start) -> kj::Maybe<Connection&> {
+    for (auto ii = 0u; ii < size; ++ii) {
+      KJ_IF_MAYBE(connection, slots_[(start + ii) % size]) {
+	return **connection;
+      }
+    }
+    return nullptr;
+  };
+
+  KJ_IF_MAYBE(first, probe(next())) {
+    auto& second = KJ_ASSERT_NONNULL(probe(next()));
+    return second.outstanding_ < first->outstanding_ ? second : *first;
+  }
+  return nullptr;
+}
+
+}
@@ -0,0 +1,75 @@
+#pragma once
+// Copyright (c) 2023 Vaci Koblizek.
+// Licensed under the Apache 2.0 license found in the LICENSE file or at:
+//     https://opensource.org/licenses/Apache-2.0
+
+// Connections to the replicas of a service, presented as one capability.
+//
+// Each call is forwarded to one of the connections currently up, chosen by
+// the power of two choices: of two connections picked at random, the one
+// with fewer calls outstanding. Connections that fail are replaced in the
+// background, and calls made while none is up wait for the first.
+//
+// Calls on capabilities returned by a call stay on the connection that
+// returned them, and fail with it.
+
+#include "aeron-rpc.h"
+
+#include <capnp/capability.h>
+#include <kj/timer.h>
+
+namespace aeroncap {
+
+struct PoolTarget {
+  kj::StringPtr channel;
+  int32_t streamId;
+};
+
+struct ConnectionPool {
+
+  // Keeps `connectionsPerTarget` connections to each target. The targets
+  // and connector must outlive the pool.
+  ConnectionPool(
+    kj::Timer&,
+    Connector&,
+    kj::ArrayPtr<PoolTarget const> targets,
+    size_t connectionsPerTarget = 1,
+    kj::Duration retryDelay = 100 * kj::MILLISECONDS,
+    kj::Duration connectTimeout = 5 * kj::SECONDS);
+
+  ~ConnectionPool();
+
+  template <typename T>
+  typename T::Client bootstrap() {
+    return bootstrap().castAs<T>();
+  }
+
+  // The pool must outlive the capability.
+  capnp::Capability::Client bootstrap();
+
+  // The number of connections currently up.
+  size_t connected() const;
+
+  // Resolves once at least one connection is up.
+  kj::Promise<void> onConnected();
+
+private:
+  struct Connection;
+  struct Balancer;
+
+  kj::Promise<void> maintain(size_t slot);
+  kj::Maybe<Connection&> pick();
+
+  kj::Timer& timer_;
+  Connector& connector_;
+  kj::ArrayPtr<PoolTarget const> targets_;
+  kj::Duration retryDelay_;
+  kj::Duration connectTimeout_;
+
+  kj::Array<kj::Maybe<kj::Own<Connection>>> slots_;
+  kj::Vector<kj::Own<kj::PromiseFulfiller<void>>> waiters_;
+  uint64_t random_;
+  kj::Array<kj::Promise<void>> tasks_;
+};
+
+}
@@ -0,0 +1,115 @@
+// Copyright (c) 2023 Vaci Koblizek.
+// Licensed under the Apache 2.0 license found in the LICENSE file or at:
+//     https://opensource.org/licenses/Apache-2.0
+
+#include "relay.h"
+
+#include <kj/vector.h>
+
+namespace aeroncap {
+
+namespace {
+
+// Claims a frame of the same length, flags and reserved value, and copies
+// the fragment into it. Returns false if the caller should back off and
+// try again.
+bool tryRelay(
+    ::aeron::ExclusivePublication& pub,
+    uint8_t const* bytes,
+    ::aeron::util::index_t length,
+    uint8_t flags,
+    int64_t reservedValue) {
+
+  ::aeron::BufferClaim claim;
+
+  if (auto err = pub.tryClaim(length, claim); err > 0) {
+    auto& buffer = claim.buffer();
+    memcpy(buffer.buffer() + claim.offset(), bytes, length);
+    claim.flags(flags);
+    claim.reservedValue(reservedValue);
+    claim.commit();
+    return true;
+  }
+  else if (err == ::aeron::BACK_PRESSURED || err == ::aeron::ADMIN_ACTION) {
+    return false;
+  }
+  else {
+    kj::throwFatalException(toException(err));
+  }
+}
+
+kj::Array<kj::ArrayPtr<capnp::word const>> segmentsOf(capnp::MessageReader& reader) {
+  kj::Vector<kj::ArrayPtr<capnp::word const>> segments;
+  for (auto ii = 0u;; ++ii) {
+    auto segment = reader.getSegment(ii);
+    if (segment == nullptr) {
+      return segments.releaseAsArray();
+    }
+    segments.add(segment);
+  }
+}
+
+}
+
+kj::Promise<void> relay(
+    AeronMessageStreamBase& from,
+    AeronMessageStreamBase& to,
+    int fragmentLimit) {
+
+  auto& image = from.getImage();
+  auto& pub = to.getPublication();
+  int32_t maxFragmentLength = image.mtuLength() - ::aeron::DataFrameHeader::LENGTH;
+  KJ_REQUIRE(pub.maxPayloadLength() >= maxFragmentLength,
+	     "Relay would have to split fragments",
+	     pub.maxPayloadLength(), maxFragmentLength);
+
+  while (true) {
+    KJ_IF_MAYBE(reader, from.popEarlyMessage()) {
+      auto segments = segmentsOf(**reader);
+      co_await to.writeMessage(nullptr, segments);
+      continue;
+    }
+    break;
+  }
+
+  auto& readIdler = from.getReadIdler();
+  auto& writeIdler = to.getWriteIdler();
+  bool backPressured = false;
+  bool backedOff = false;
+
+  while (true) {
+    auto fragmentsRead = image.controlledPoll(
+      [&](auto& buffer, auto offset, auto length, auto& header) {
+	if (tryRelay(pub, buffer.buffer() + offset, length,
+		     header.flags(), header.reservedValue())) {
+	  return ::aeron::ControlledPollAction::CONTINUE;
+	}
+	// polled again once there is room
+	backPressured = true;
+	return ::aeron::ControlledPollAction::ABORT;
+      },
+      fragmentLimit);
+
+    if (backPressured) {
+      backPressured = false;
+      backedOff = true;
+      co_await writeIdler.idle();
+      continue;
+    }
+    if (backedOff) {
+      backedOff = false;
+      writeIdler.reset();
+    }
+
+    if (KJ_UNLIKELY(image.isEndOfStream())) {
+      co_return;
+    }
+
+    if (fragmentsRead) {
+      readIdler.reset();
+    }
+    co_await readIdler.idle();
+  }
+}
+
+}
@@ -0,0 +1,27 @@
+#pragma once
+// Copyright (c) 2023 Vaci Koblizek.
+// Licensed under the Apache 2.0 license found in the LICENSE file or at:
+//     https://opensource.org/licenses/Apache-2.0
+
+// Relays the frames of one stream to another as they are, for gateways
+// that only forward traffic between networks. Each fragment is claimed on
+// the outgoing publication and copied once, with its flags and reserved
+// value, so fragmented messages are never reassembled, and nothing is
+// parsed. Multiplexed sessions and traces pass through unchanged, while
+// blob handles are only of use to a peer on the same host as the writer.
+
+#include "serialize.h"
+
+namespace aeroncap {
+
+// Resolves once the image of `from` reaches the end of its stream. The
+// publication of `to` must take frames at least as large as those of the
+// image, and nothing else may write to it meanwhile, lest the fragments of
+// a message interleave with others. Messages that arrived during the
+// handshake, which are already read, are written first.
+kj::Promise<void> relay(
+  AeronMessageStreamBase& from,
+  AeronMessageStreamBase& to,
+  int fragmentLimit = 16);
+
+}
@@ -13,131 +13,136 @@ namespace aeroncap {
 
 namespace {
 
-template <typename Idler>
-kj::Promise<void> writeClaim(
-    ::aeron::ExclusivePublication& pub,
-    kj::ArrayPtr<kj::ArrayPtr<capnp::word const> const> segments,
-    uint64_t byteSize,
-    Idler& idler) {
-
-  KJ_DREQUIRE(byteSize <= pub_.maxPayloadLength());
-  KJ_DREQUIRE(byteSize > 0);
-
-  ::aeron::BufferClaim claim;
-
-  if (auto err = pub.tryClaim(byteSize, claim); err > 0) {
-    auto& buffer = claim.buffer();
-    auto offset = claim.offset();
-    auto array = kj::arrayPtr(buffer.buffer() + offset, byteSize);
-    kj::ArrayOutputStream outputStream{array};
-    capnp::writeMessage(outputStream, segments);
-    claim.commit();
-    return kj::READY_NOW;
-  }
-  else if (err == ::aeron::BACK_PRESSURED || err == ::aeron::ADMIN_ACTION) {
-    return idler.idle().then(
-      [&pub, segments, byteSize, &idler]() mutable {
-	return writeClaim(pub, segments, byteSize, idler);
-      }
-    );
+// Reader for the common case of a message with a single segment, which
+// avoids parsing the segment table and allocating a segment vector.
+struct SingleSegmentMessageReader final
+  : capnp::MessageReader {
+
+  SingleSegmentMessageReader(
+    kj::ArrayPtr<capnp::word const> segment,
+    kj::Array<capnp::word> ownedSpace,
+    capnp::ReaderOptions options)
+    : capnp::MessageReader{options}
+    , segment_{segment}
+    , ownedSpace_{kj::mv(ownedSpace)} {
   }
-  else {
-    kj::throwFatalException(toException(err));
+
+  static kj::Own<capnp::MessageReader> copy(
+    kj::ArrayPtr<capnp::word const> segment,
+    kj::ArrayPtr<capnp::word> scratchSpace,
+    capnp::ReaderOptions options) {
+
+    kj::Array<capnp::word> ownedSpace;
+    if (scratchSpace.size() < segment.size()) {
+      ownedSpace = kj::heapArray<capnp::word>(segment.size());
+      scratchSpace = ownedSpace;
+    }
+    memcpy(scratchSpace.begin(), segment.begin(), segment.asBytes().size());
+    return kj::heap<SingleSegmentMessageReader>(
+      scratchSpace.slice(0, segment.size()), kj::mv(ownedSpace), options);
+  }
+
+  kj::ArrayPtr<capnp::word const> getSegment(uint id) override {
+    return id == 0 ? segment_ : nullptr;
   }
+
+  kj::ArrayPtr<capnp::word const> segment_;
+  kj::Array<capnp::word> ownedSpace_;
+};
+
 }
 
-template <typename Idler>
-kj::Promise<void> writeOffer(
-    ::aeron::ExclusivePublication& pub,
-    kj::ArrayPtr<capnp::byte> bytes,
-    Idler& idler) {
+namespace _ {
 
-  KJ_DREQUIRE(bytes.size() <= pub.maxMessageLength());
-  KJ_DREQUIRE(bytes.size > 0);
+kj::Maybe<size_t> singleSegmentSize(uint8_t const* bytes, size_t length) {
+  if constexpr (__BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__) {
+    return nullptr;
+  }
 
-  if (auto err = pub.offer({bytes.begin(), bytes.size()}); err > 0) {
-    return kj::READY_NOW;
+  if (KJ_UNLIKELY(length < sizeof(capnp::word))) {
+    return nullptr;
   }
-  else if (err == ::aeron::BACK_PRESSURED || err == ::aeron::ADMIN_ACTION) {
-    return idler.idle().then(
-      [&pub, bytes, &idler]() mutable {
-	return writeOffer(pub, bytes, idler);
-      }
-    );
+
+  uint64_t table;
+  memcpy(&table, bytes, sizeof(table));
+  if (static_cast<uint32_t>(table) != 0) {
+    return nullptr;
   }
-  else {
-    kj::throwFatalException(toException(err));
+
+  size_t segmentSize = table >> 32;
+  KJ_REQUIRE((segmentSize + 1) * sizeof(capnp::word) <= length,
+	     "Message ends prematurely in first segment.") {
+    return nullptr;
   }
+  return segmentSize;
 }
 
-template <typename Idler>
-kj::Promise<kj::Maybe<kj::Own<capnp::MessageReader>>> tryReadMessage(
-  Idler& idler,
-  ::aeron::Image image,
+MessageAssembler::MessageAssembler(
   capnp::ReaderOptions options,
-  kj::ArrayPtr<capnp::word> scratchSpace = nullptr,
-  kj::Own<kj::VectorOutputStream> outputStream = {}) {
-
-  using Action = ::aeron::ControlledPollAction;
-
-  kj::Maybe<kj::Own<capnp::MessageReader>> reader;
-
-  auto handler = [&, scratchSpace](auto& buffer, auto offset, auto length, auto& header) mutable {
-    namespace frame = ::aeron::FrameDescriptor;
+  kj::ArrayPtr<capnp::word> scratchSpace,
+  kj::Maybe<StreamTrace&> trace,
+  kj::Maybe<BlobMapper&> blobs)
+  : options_{options}
+  , scratchSpace_{scratchSpace}
+  , trace_{trace}
+  , blobs_{blobs} {
+}
 
-    auto isSet = [&header](auto bits) {
-      return (header.flags() & bits) == bits;
-    };
+MessageAssembler::~MessageAssembler() {
+}
 
-    if (isSet(frame::UNFRAGMENTED)) {
-      kj::Array<capnp::word> ownedSpace;
-      auto wordSize = (length+1)/sizeof(capnp::word);
+::aeron::ControlledPollAction MessageAssembler::onFragment(
+    uint8_t const* bytes, size_t length, uint8_t flags) {
+  using Action = ::aeron::ControlledPollAction;
+  namespace frame = ::aeron::FrameDescriptor;
 
-      if (scratchSpace.size() < wordSize) {
-	ownedSpace = kj::heapArray<capnp::word>(wordSize);
-	scratchSpace = ownedSpace;
-      }
-      memcpy(scratchSpace.begin(), buffer.buffer() + offset, length);
+  auto isSet = [flags](auto bits) {
+    return (flags & bits) == bits;
+  };
 
-      reader = kj::heap<capnp::FlatArrayMessageReader>(scratchSpace, options)
-	.attach(kj::mv(ownedSpace));
+  if (isSet(frame::UNFRAGMENTED)) {
+    if (KJ_UNLIKELY(BlobMapper::isHandle(bytes, length))) {
+      auto& blobs = KJ_REQUIRE_NONNULL(blobs_, "Blob handle read on a stream not accepting blobs");
+      reader_ = blobs.read(bytes, length, options_);
       return Action::BREAK;
     }
 
-    if (isSet(frame::BEGIN_FRAG)) {
-      outputStream = kj::heap<kj::VectorOutputStream>();
+    KJ_IF_MAYBE(segmentSize, singleSegmentSize(bytes, length)) {
+      auto segment = kj::arrayPtr(
+	reinterpret_cast<capnp::word const*>(bytes) + 1, *segmentSize);
+      reader_ = SingleSegmentMessageReader::copy(segment, scratchSpace_, options_);
+      return Action::BREAK;
     }
 
-    outputStream->write(buffer.buffer() + offset, length);
+    kj::Array<capnp::word> ownedSpace;
+    auto scratchSpace = scratchSpace_;
+    auto wordSize = (length + sizeof(capnp::word) - 1)/sizeof(capnp::word);
 
-    if (isSet(frame::END_FRAG)) {
-      auto inputStream = kj::heap<kj::ArrayInputStream>(outputStream->getArray());
-      reader = kj::heap<capnp::InputStreamMessageReader>(*inputStream)
-	.attach(kj::mv(inputStream), kj::mv(outputStream));
-      return Action::BREAK;
+    if (scratchSpace.size() < wordSize) {
+      ownedSpace = kj::heapArray<capnp::word>(wordSize);
+      scratchSpace = ownedSpace;
     }
+    memcpy(scratchSpace.begin(), bytes, length);
 
-    return Action::CONTINUE;
-  };
-
-  auto fragmentsRead = image.controlledPoll(handler, 16);
-  if (reader != nullptr) {
-    return kj::mv(reader);
+    reader_ = kj::heap<capnp::FlatArrayMessageReader>(scratchSpace, options_)
+      .attach(kj::mv(ownedSpace));
+    return Action::BREAK;
   }
 
-  if (KJ_UNLIKELY(image.isEndOfStream())) {
-    return nullptr;
+  if (isSet(frame::BEGIN_FRAG)) {
+    outputStream_ = kj::heap<kj::VectorOutputStream>();
   }
 
-  if (fragmentsRead) {
-    idler.reset();
+  outputStream_->write(bytes, length);
+
+  if (isSet(frame::END_FRAG)) {
+    auto inputStream = kj::heap<kj::ArrayInputStream>(outputStream_->getArray());
+    reader_ = kj::heap<capnp::InputStreamMessageReader>(*inputStream, options_)
+      .attach(kj::mv(inputStream), kj::mv(outputStream_));
+    return Action::BREAK;
   }
 
-  return idler.idle().then(
-    [&idler, image = kj::mv(image), options, scratchSpace, outputStream = kj::mv(outputStream)]() mutable {
-      return tryReadMessage(idler, kj::mv(image), options, scratchSpace, kj::mv(outputStream));
-    }
-  );
+  return Action::CONTINUE;
 }
 
 }
@@ -147,80 +152,160 @@ kj::Promise<kj::Own<capnp::MessageReader>> readMessage(
   ::aeron::Image image,
   capnp::ReaderOptions options) {
 
-  return tryReadMessage(idler, kj::mv(image), options)
-    .then(
-      [](auto maybeReader) -> kj::Promise<kj::Own<capnp::MessageReader>> {
-	auto& reader = KJ_UNWRAP_OR_RETURN(maybeReader, KJ_EXCEPTION(DISCONNECTED));
-	return kj::mv(reader);
-      }
-    );
+  auto maybeReader = co_await _::tryReadMessage(idler, image, options);
+  KJ_IF_MAYBE(reader, maybeReader) {
+    co_return kj::mv(*reader);
+  }
+  kj::throwFatalException(KJ_EXCEPTION(DISCONNECTED, "End of stream"));
+}
+
+kj::Promise<void> writeMessage(
+  Idler& idler,
+  ::aeron::ExclusivePublication& pub,
+  kj::ArrayPtr<kj::ArrayPtr<capnp::word const> const> segments) {
+  return _::writeMessage(idler, pub, segments);
+}
+
+kj::Promise<void> writeMessage(
+  Idler& idler,
+  ::aeron::Publication& pub,
+  kj::ArrayPtr<kj::ArrayPtr<capnp::word const> const> segments) {
+  return _::writeMessage(idler, pub, segments);
 }
 
-AeronMessageStream::AeronMessageStream(
+AeronMessageStreamBase::AeronMessageStreamBase(
   ::aeron::ExclusivePublication& pub,
   ::aeron::Image image,
-  Idler& readIdler,
-  Idler& writeIdler)
+  capnp::ReaderOptions options)
   : pub_{pub}
   , image_{kj::mv(image)}
-  , readIdler_{readIdler}
-  , writeIdler_{writeIdler} {
+  , options_{options} {
 }
 
-AeronMessageStream::~AeronMessageStream() {
+AeronMessageStreamBase::~AeronMessageStreamBase() {
   pub_.close();
   image_.close();
 }
 
-kj::Promise<kj::Maybe<capnp::MessageReaderAndFds>> AeronMessageStream::tryReadMessage(
-    kj::ArrayPtr<kj::AutoCloseFd> fdSpace,
-    capnp::ReaderOptions options,
-    kj::ArrayPtr<capnp::word> scratchSpace) {
-
-  return aeroncap::tryReadMessage(readIdler_, image_, options, scratchSpace).then(
-      [](auto maybeReader) -> kj::Maybe<capnp::MessageReaderAndFds> {
-	auto& reader = KJ_UNWRAP_OR_RETURN(maybeReader, nullptr);
-	return capnp::MessageReaderAndFds{kj::mv(reader), nullptr};
-      }
-  );
+void AeronMessageStreamBase::disconnectWhen(kj::Promise<void> disconnected) {
+  watcher_ = disconnected.catch_([this](kj::Exception&& exc) {
+    canceler_.cancel(exc);
+    for (auto& waiter: disconnectWaiters_) {
+      waiter->reject(kj::cp(exc));
+    }
+    disconnectWaiters_.clear();
+    disconnected_ = kj::mv(exc);
+  }).eagerlyEvaluate(nullptr);
 }
 
-kj::Promise<void> AeronMessageStream::writeMessages(
-    kj::ArrayPtr<kj::ArrayPtr<kj::ArrayPtr<capnp::word const> const>> messages) {
+kj::Promise<void> AeronMessageStreamBase::whenDisconnected() {
+  KJ_IF_MAYBE(exc, disconnected_) {
+    return kj::cp(*exc);
+  }
+  auto paf = kj::newPromiseAndFulfiller<void>();
+  disconnectWaiters_.add(kj::mv(paf.fulfiller));
+  return kj::mv(paf.promise);
+}
 
-  auto builder = kj::heapArrayBuilder<kj::Promise<void>>(messages.size());
-  for (auto msg: messages) {
-    builder.add(writeMessage(nullptr, msg));
+StreamTrace& AeronMessageStreamBase::enableTracing() {
+  KJ_REQUIRE(!multiplexed_,
+	     "A multiplexed stream can't be traced, as both use the reserved value");
+  if (trace_ == nullptr) {
+    trace_ = kj::refcounted<StreamTrace>();
   }
-  return kj::joinPromises(builder.finish());
+  return KJ_ASSERT_NONNULL(getTrace());
 }
 
-kj::Promise<void> AeronMessageStream::writeMessage(
-    kj::ArrayPtr<int const> fds,
-    kj::ArrayPtr<kj::ArrayPtr<capnp::word const> const> segments) {
+void AeronMessageStreamBase::enableBlobs(kj::Own<BlobPool> pool, size_t threshold) {
+  kj::StringPtr channel = pub_.channel().c_str();
+  KJ_REQUIRE(channel.startsWith("aeron:ipc"),
+	     "Blobs need both ends on the same host", channel);
+  KJ_REQUIRE(peerAcceptsBlobs_, "The peer doesn't read blob handles");
+  blobPool_ = kj::mv(pool);
+  blobThreshold_ = threshold;
+}
 
-  auto wordSize = capnp::computeSerializedSizeInWords(segments);
-  auto byteSize = wordSize * sizeof(capnp::word);
+void AeronMessageStreamBase::acceptBlobs(kj::StringPtr poolPrefix) {
+  kj::StringPtr source = image_.sourceIdentity().c_str();
+  KJ_REQUIRE(source == "aeron:ipc",
+	     "Blobs need both ends on the same host", source);
+  blobMapper_.emplace(poolPrefix);
+}
 
-  KJ_DREQUIRE(byteSize > 0);
-  KJ_DREQUIRE(byteSize <= pub_.maxMessageLength());
+kj::Maybe<kj::Own<BlobPool::Placement>> AeronMessageStreamBase::tryPlaceBlob(
+    kj::ArrayPtr<kj::ArrayPtr<capnp::word const> const> segments) {
+  KJ_IF_MAYBE(pool, blobPool_) {
+    auto byteSize = capnp::computeSerializedSizeInWords(segments) * sizeof(capnp::word);
+    if (byteSize >= blobThreshold_) {
+      return (*pool)->tryPlace(segments);
+    }
+  }
+  return nullptr;
+}
 
-  if (byteSize <= pub_.maxPayloadLength()) {
-    return writeClaim(pub_, segments, byteSize, writeIdler_);
+kj::Promise<void> AeronMessageStreamBase::writeBlob(kj::Own<BlobPool::Placement> blob) {
+  auto& idler = getWriteIdler();
+  auto trace = getTrace();
+  uint16_t seq = 0;
+  KJ_IF_MAYBE(t, trace) {
+    seq = t->nextSeq();
   }
-  else {
-    auto words = capnp::messageToFlatArray(segments);
-    return writeOffer(pub_, words.asBytes(), writeIdler_).attach(kj::mv(words));
+  auto reservedValue = [trace, seq]() -> int64_t {
+    KJ_IF_MAYBE(t, trace) {
+      return t->stamp(seq);
+    }
+    return 0;
+  };
+
+  if (!_::tryOffer(pub_, blob->getFrame(), reservedValue())) {
+    do {
+      co_await idler.idle();
+    } while (!_::tryOffer(pub_, blob->getFrame(), reservedValue()));
+    idler.reset();
+  }
+  blob->sent();
+}
+
+kj::Promise<void> AeronMessageStreamBase::writeMessages(
+    kj::ArrayPtr<kj::ArrayPtr<kj::ArrayPtr<capnp::word const> const>> messages) {
+
+  // one at a time, so that a back pressured message cannot be overtaken
+  for (auto msg: messages) {
+    co_await writeMessage(nullptr, msg);
   }
 }
 
-kj::Promise<void> AeronMessageStream::end() {
+kj::Promise<void> AeronMessageStreamBase::end() {
   pub_.close();
   return kj::READY_NOW;
 }
 
-kj::Maybe<int> AeronMessageStream::getSendBufferSize() {
-  return pub_.termBufferLength();
+kj::Maybe<int> AeronMessageStreamBase::getSendBufferSize() {
+  int64_t termLength = pub_.termBufferLength();
+  if (KJ_UNLIKELY(pub_.isClosed())) {
+    return termLength;
+  }
+
+  auto position = pub_.position();
+  auto limit = pub_.positionLimit();
+
+  // exponentially weighted, as this is called for every message sent
+  auto smooth = [](int64_t& average, int64_t sample) {
+    average += (sample - average) / 8;
+  };
+  auto headroom = kj::max(limit - position, int64_t{0});
+  if (lastLimit_) {
+    smooth(headroom_, headroom);
+    smooth(advance_, kj::max(limit - lastLimit_, int64_t{0}));
+  }
+  else {
+    headroom_ = headroom;
+  }
+  lastLimit_ = limit;
+
+  int64_t maxPayloadLength = pub_.maxPayloadLength();
+  auto window = kj::min(kj::max(headroom_ + advance_, maxPayloadLength), termLength);
+  return static_cast<int>(window);
 }
 
 }
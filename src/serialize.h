@@ -3,52 +3,451 @@
 // Licensed under the Apache 2.0 license found in the LICENSE file or at:
 //     https://opensource.org/licenses/Apache-2.0
 
+#include "blob.h"
+#include "common.h"
 #include "idle.h"
+#include "trace.h"
 
 #include <Aeron.h>
 #include <capnp/serialize-async.h>
+#include <capnp/serialize.h>
+#include <kj/vector.h>
 
 namespace aeroncap {
 
+namespace _ {
+
+// Each of the try* functions below makes a single non-blocking attempt to
+// publish a message, and returns the new position of the stream, or zero
+// if the caller should idle and try again. The reserved value is stamped
+// into the header of every frame.
+
+template <typename Publication>
+int64_t tryClaim(
+    Publication& pub,
+    kj::ArrayPtr<kj::ArrayPtr<capnp::word const> const> segments,
+    uint64_t byteSize,
+    int64_t reservedValue = 0) {
+
+  KJ_DREQUIRE(byteSize <= pub.maxPayloadLength());
+  KJ_DREQUIRE(byteSize > 0);
+
+  ::aeron::BufferClaim claim;
+
+  if (auto err = pub.tryClaim(byteSize, claim); err > 0) {
+    auto& buffer = claim.buffer();
+    auto offset = claim.offset();
+    auto array = kj::arrayPtr(buffer.buffer() + offset, byteSize);
+    kj::ArrayOutputStream outputStream{array};
+    capnp::writeMessage(outputStream, segments);
+    claim.reservedValue(reservedValue);
+    claim.commit();
+    return err;
+  }
+  else if (err == ::aeron::BACK_PRESSURED || err == ::aeron::ADMIN_ACTION) {
+    return 0;
+  }
+  else {
+    kj::throwFatalException(toException(err));
+  }
+}
+
+template <typename Publication>
+int64_t tryOffer(
+    Publication& pub,
+    kj::ArrayPtr<capnp::byte> bytes,
+    int64_t reservedValue = 0) {
+
+  KJ_DREQUIRE(bytes.size() <= pub.maxMessageLength());
+  KJ_DREQUIRE(bytes.size() > 0);
+
+  ::aeron::concurrent::AtomicBuffer buffer{bytes.begin(), bytes.size()};
+  auto supplier = [reservedValue](auto&, auto, auto) {
+    return reservedValue;
+  };
+
+  if (auto err = pub.offer(buffer, 0, bytes.size(), supplier); err > 0) {
+    return err;
+  }
+  else if (err == ::aeron::BACK_PRESSURED || err == ::aeron::ADMIN_ACTION) {
+    return 0;
+  }
+  else {
+    kj::throwFatalException(toException(err));
+  }
+}
+
+// Inspects the segment table with a single 8-byte load, and returns the
+// size in words of the only segment if the message has exactly one, and
+// the fragment holds all of it.
+kj::Maybe<size_t> singleSegmentSize(uint8_t const* bytes, size_t length);
+
+// Reassembles capnp messages from the fragments of an image.
+struct MessageAssembler {
+
+  MessageAssembler(
+    capnp::ReaderOptions options,
+    kj::ArrayPtr<capnp::word> scratchSpace = nullptr,
+    kj::Maybe<StreamTrace&> trace = nullptr,
+    kj::Maybe<BlobMapper&> blobs = nullptr);
+
+  ~MessageAssembler();
+
+  // Polls the image until a whole message is available, and returns the
+  // number of fragments read.
+  template <typename Image>
+  int poll(Image& image, int fragmentLimit = 16) {
+    return image.controlledPoll(
+      [this](auto& buffer, auto offset, auto length, auto& header) {
+	auto flags = header.flags();
+	KJ_IF_MAYBE(trace, trace_) {
+	  if (flags & ::aeron::FrameDescriptor::BEGIN_FRAG) {
+	    trace->onPoll(header.reservedValue());
+	  }
+	}
+	return onFragment(buffer.buffer() + offset, length, flags);
+      },
+      fragmentLimit
+    );
+  }
+
+  // For callers polling the image themselves.
+  ::aeron::ControlledPollAction onFragment(
+    uint8_t const* bytes, size_t length, uint8_t flags);
+
+  kj::Maybe<kj::Own<capnp::MessageReader>> release() {
+    return kj::mv(reader_);
+  }
+
+private:
+  capnp::ReaderOptions options_;
+  kj::ArrayPtr<capnp::word> scratchSpace_;
+  kj::Maybe<StreamTrace&> trace_;
+  kj::Maybe<BlobMapper&> blobs_;
+  kj::Own<kj::VectorOutputStream> outputStream_;
+  kj::Maybe<kj::Own<capnp::MessageReader>> reader_;
+};
+
+// Resolves to the next whole message of the image, or null at the end of
+// the stream. The image, and trace and blob mapper if any, must outlive
+// the promise.
+template <int fragmentLimit = 16, typename Image, typename Idler>
+kj::Promise<kj::Maybe<kj::Own<capnp::MessageReader>>> tryReadMessage(
+  Idler& idler,
+  Image& image,
+  capnp::ReaderOptions options,
+  kj::ArrayPtr<capnp::word> scratchSpace = nullptr,
+  kj::Maybe<StreamTrace&> trace = nullptr,
+  kj::Maybe<BlobMapper&> blobs = nullptr) {
+
+  MessageAssembler assembler{options, scratchSpace, trace, blobs};
+
+  while (true) {
+    auto fragmentsRead = assembler.poll(image, fragmentLimit);
+    KJ_IF_MAYBE(reader, assembler.release()) {
+      KJ_IF_MAYBE(t, trace) {
+	t->onDelivery();
+      }
+      co_return kj::mv(*reader);
+    }
+
+    if (KJ_UNLIKELY(image.isEndOfStream())) {
+      co_return nullptr;
+    }
+
+    if (fragmentsRead) {
+      idler.reset();
+    }
+
+    co_await idler.idle();
+  }
+}
+
+struct NoReservedValue {
+  constexpr int64_t operator()() const { return 0; }
+};
+
+// Writes a message, claiming in place when it fits in a single frame and
+// otherwise offering it to be fragmented. `reservedValue` is called for the
+// reserved value of each attempt, e.g. to stamp it with the time it is
+// actually sent.
+template <typename Publication, typename Idler, typename ReservedValue = NoReservedValue>
+kj::Promise<void> writeMessage(
+  Idler& idler,
+  Publication& pub,
+  kj::ArrayPtr<kj::ArrayPtr<capnp::word const> const> segments,
+  ReservedValue reservedValue = {}) {
+
+  auto wordSize = capnp::computeSerializedSizeInWords(segments);
+  auto byteSize = wordSize * sizeof(capnp::word);
+
+  KJ_DREQUIRE(byteSize > 0);
+  KJ_DREQUIRE(byteSize <= pub.maxMessageLength());
+
+  if (byteSize <= pub.maxPayloadLength()) {
+    if (tryClaim(pub, segments, byteSize, reservedValue())) {
+      co_return;
+    }
+    do {
+      co_await idler.idle();
+    } while (!tryClaim(pub, segments, byteSize, reservedValue()));
+  }
+  else {
+    auto words = capnp::messageToFlatArray(segments);
+    if (tryOffer(pub, words.asBytes(), reservedValue())) {
+      co_return;
+    }
+    do {
+      co_await idler.idle();
+    } while (!tryOffer(pub, words.asBytes(), reservedValue()));
+  }
+
+  // we had to back off, so start afresh next time
+  idler.reset();
+}
+
+}
+
 kj::Promise<kj::Own<capnp::MessageReader>> readMessage(
   Idler&,
   ::aeron::Image image,
   capnp::ReaderOptions options = {}
 );
 
-struct AeronMessageStream final
+kj::Promise<void> writeMessage(
+  Idler&,
+  ::aeron::ExclusivePublication&,
+  kj::ArrayPtr<kj::ArrayPtr<capnp::word const> const> segments
+);
+
+kj::Promise<void> writeMessage(
+  Idler&,
+  ::aeron::Publication&,
+  kj::ArrayPtr<kj::ArrayPtr<capnp::word const> const> segments
+);
+
+// Parameters applied to the channel of each publication created during the
+// handshake, so that term buffers can be sized to the expected messages and
+// kept on the unfragmented path. Zero values leave the media driver's
+// defaults in place, as do params the channel URI already sets.
+struct PublicationParams {
+  uint32_t termLength{0};
+  uint32_t mtu{0};
+  bool sparse{true};
+  uint32_t socketSndbufLength{0};
+  uint32_t socketRcvbufLength{0};
+};
+
+// What is common to every `BasicAeronMessageStream`, whatever its idlers.
+struct AeronMessageStreamBase
   : capnp::MessageStream {
 
-  AeronMessageStream(
+  AeronMessageStreamBase(
     ::aeron::ExclusivePublication&,
     ::aeron::Image,
-    Idler& readIdler,
-    Idler& writeIdler
+    capnp::ReaderOptions = {}
   );
 
-  ~AeronMessageStream();
+  ~AeronMessageStreamBase();
 
-  kj::Promise<kj::Maybe<capnp::MessageReaderAndFds>> tryReadMessage(
-    kj::ArrayPtr<kj::AutoCloseFd>,
-    capnp::ReaderOptions = capnp::ReaderOptions{},
-    kj::ArrayPtr<capnp::word> scratchSpace = nullptr) override;
+  // Options with which this stream's messages should be read, e.g. by
+  // `TwoPartyVatNetwork`.
+  capnp::ReaderOptions getReaderOptions() const { return options_; }
 
-  kj::Promise<void> writeMessage(
-    kj::ArrayPtr<int const>,
-    kj::ArrayPtr<kj::ArrayPtr<capnp::word const> const>) override;
+  ::aeron::ExclusivePublication& getPublication() { return pub_; }
+  ::aeron::Image& getImage() { return image_; }
+  virtual Idler& getReadIdler() = 0;
+  virtual Idler& getWriteIdler() = 0;
+
+  // Whether the peer will multiplex many logical streams over this one,
+  // see `MultiplexedSession`.
+  bool isMultiplexed() const { return multiplexed_; }
+  void setMultiplexed(bool multiplexed) {
+    KJ_REQUIRE(!multiplexed || trace_ == nullptr,
+	       "A traced stream can't be multiplexed, as both use the reserved value");
+    multiplexed_ = multiplexed;
+  }
+
+  // Queues a message that arrived during the handshake, to be read before
+  // anything on the image.
+  void pushEarlyMessage(kj::Own<capnp::MessageReader> reader) {
+    earlyMessages_.push(kj::mv(reader));
+  }
+
+  // Takes the next of those messages, for readers bypassing `readMessage`.
+  kj::Maybe<kj::Own<capnp::MessageReader>> popEarlyMessage() {
+    if (earlyMessages_.empty()) {
+      return nullptr;
+    }
+    return earlyMessages_.pop();
+  }
+
+  // Fails pending and future reads and writes as soon as `disconnected`
+  // rejects, typically when the image becomes unavailable.
+  void disconnectWhen(kj::Promise<void> disconnected);
+
+  // Rejects once the stream has been disconnected that way, e.g. for a
+  // `MultiplexedSession` polling the image itself to follow suit.
+  kj::Promise<void> whenDisconnected();
+
+  // Stamps every frame written from now on, and records the latencies of
+  // stamped messages read, see `StreamTrace`. Returns the trace, which may
+  // be kept beyond the stream. Not for multiplexed streams, whose frames'
+  // reserved values are already taken.
+  StreamTrace& enableTracing();
+
+  kj::Maybe<StreamTrace&> getTrace() {
+    KJ_IF_MAYBE(trace, trace_) {
+      return **trace;
+    }
+    return nullptr;
+  }
+
+  // Places messages of at least `threshold` bytes in `pool`, and publishes
+  // only their handles, see blob.h. The peer must be on the same host, so
+  // the publication must be on aeron:ipc, and must have agreed to read
+  // handles. Messages that don't fit, or find the pool full, are published
+  // as usual.
+  void enableBlobs(kj::Own<BlobPool> pool, size_t threshold);
+
+  // Follows blob handles read on the image to pools whose names start with
+  // `poolPrefix`. The image must be on aeron:ipc. Until this is called, a
+  // handle fails the read.
+  void acceptBlobs(kj::StringPtr poolPrefix);
+
+  kj::Maybe<BlobMapper&> getBlobMapper() {
+    KJ_IF_MAYBE(mapper, blobMapper_) {
+      return *mapper;
+    }
+    return nullptr;
+  }
+
+  // Whether the peer reads blob handles, as agreed during the handshake.
+  bool peerAcceptsBlobs() const { return peerAcceptsBlobs_; }
+  void setPeerAcceptsBlobs(bool accepts) { peerAcceptsBlobs_ = accepts; }
+
+  // The params the peer's publication, i.e. the image, was created with,
+  // as reported in the Ack. All zero for a stream accepted by a Listener.
+  PublicationParams const& getPeerParams() const { return peerParams_; }
+  void setPeerParams(PublicationParams const& params) { peerParams_ = params; }
 
   kj::Promise<void> writeMessages(
     kj::ArrayPtr<kj::ArrayPtr<kj::ArrayPtr<capnp::word const> const>>) override;
 
   kj::Promise<void> end() override;
 
+  // The flow control window for streaming calls. This is derived from the
+  // room left below the publication limit, plus how fast the receiver has
+  // been moving that limit on, so that a stream neither back pressures the
+  // publication nor starves a fast link.
   kj::Maybe<int> getSendBufferSize() override;
 
-private:
+protected:
   ::aeron::ExclusivePublication& pub_;
   ::aeron::Image image_;
-  Idler& readIdler_;
-  Idler& writeIdler_;
+  capnp::ReaderOptions options_;
+  bool multiplexed_{false};
+  Queue<kj::Own<capnp::MessageReader>> earlyMessages_;
+  kj::Maybe<BlobMapper> blobMapper_;
+  bool peerAcceptsBlobs_{false};
+  PublicationParams peerParams_{.sparse = false};
+
+  // Places the message in the blob pool if it should go that way.
+  kj::Maybe<kj::Own<BlobPool::Placement>> tryPlaceBlob(
+    kj::ArrayPtr<kj::ArrayPtr<capnp::word const> const> segments);
+
+  // Publishes the handle of a placed message.
+  kj::Promise<void> writeBlob(kj::Own<BlobPool::Placement>);
+
+  template <typename T>
+  kj::Promise<T> guard(kj::Promise<T> promise) {
+    KJ_IF_MAYBE(exc, disconnected_) {
+      return kj::cp(*exc);
+    }
+    return canceler_.wrap(kj::mv(promise));
+  }
+
+private:
+  kj::Canceler canceler_;
+  kj::Maybe<kj::Exception> disconnected_;
+  kj::Promise<void> watcher_{kj::NEVER_DONE};
+  kj::Vector<kj::Own<kj::PromiseFulfiller<void>>> disconnectWaiters_;
+
+  kj::Maybe<kj::Own<StreamTrace>> trace_;
+
+  kj::Maybe<kj::Own<BlobPool>> blobPool_;
+  size_t blobThreshold_{0};
+
+  int64_t lastLimit_{0};
+  int64_t headroom_{0};
+  int64_t advance_{0};
 };
 
+// A message stream over an exclusive publication and an image. Given
+// concrete idler types, held by value, the read and write loops call them
+// directly, and can inline them.
+template <typename ReadIdler, typename WriteIdler, int fragmentLimit = 16>
+struct BasicAeronMessageStream final
+  : AeronMessageStreamBase {
+
+  BasicAeronMessageStream(
+    ::aeron::ExclusivePublication& pub,
+    ::aeron::Image image,
+    ReadIdler readIdler,
+    WriteIdler writeIdler,
+    capnp::ReaderOptions options = {})
+    : AeronMessageStreamBase{pub, kj::mv(image), options}
+    , readIdler_{kj::fwd<ReadIdler>(readIdler)}
+    , writeIdler_{kj::fwd<WriteIdler>(writeIdler)} {
+  }
+
+  Idler& getReadIdler() override { return readIdler_; }
+  Idler& getWriteIdler() override { return writeIdler_; }
+
+  kj::Promise<kj::Maybe<capnp::MessageReaderAndFds>> tryReadMessage(
+      kj::ArrayPtr<kj::AutoCloseFd>,
+      capnp::ReaderOptions options = capnp::ReaderOptions{},
+      kj::ArrayPtr<capnp::word> scratchSpace = nullptr) override {
+    return guard(read(options, scratchSpace));
+  }
+
+  kj::Promise<void> writeMessage(
+      kj::ArrayPtr<int const>,
+      kj::ArrayPtr<kj::ArrayPtr<capnp::word const> const> segments) override {
+    KJ_IF_MAYBE(blob, tryPlaceBlob(segments)) {
+      return guard(writeBlob(kj::mv(*blob)));
+    }
+    KJ_IF_MAYBE(trace, getTrace()) {
+      auto stamp = [trace, seq = trace->nextSeq()]() {
+	return trace->stamp(seq);
+      };
+      return guard(_::writeMessage(writeIdler_, pub_, segments, stamp));
+    }
+    return guard(_::writeMessage(writeIdler_, pub_, segments));
+  }
+
+private:
+  kj::Promise<kj::Maybe<capnp::MessageReaderAndFds>> read(
+      capnp::ReaderOptions options,
+      kj::ArrayPtr<capnp::word> scratchSpace) {
+
+    if (KJ_UNLIKELY(!earlyMessages_.empty())) {
+      co_return capnp::MessageReaderAndFds{earlyMessages_.pop(), nullptr};
+    }
+
+    auto maybeReader = co_await _::tryReadMessage<fragmentLimit>(
+      readIdler_, image_, options, scratchSpace, getTrace(), getBlobMapper());
+    KJ_IF_MAYBE(reader, maybeReader) {
+      co_return capnp::MessageReaderAndFds{kj::mv(*reader), nullptr};
+    }
+    co_return nullptr;
+  }
+
+  ReadIdler readIdler_;
+  WriteIdler writeIdler_;
+};
+
+// Type-erased idlers, for when the choice is made at runtime.
+using AeronMessageStream = BasicAeronMessageStream<Idler&, Idler&>;
+
 }
@@ -0,0 +1,78 @@
+// Copyright (c) 2023 Vaci Koblizek.
+// Licensed under the Apache 2.0 license found in the LICENSE file or at:
+//     https://opensource.org/licenses/Apache-2.0
+
+#include "trace.h"
+
+#include <time.h>
+
+namespace aeroncap {
+
+namespace {
+
+constexpr uint64_t TIMESTAMP_MASK = (uint64_t{1} << 48) - 1;
+
+uint64_t now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  auto nanos = static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+  return nanos & TIMESTAMP_MASK;
+}
+
+}
+
+int64_t StreamTrace::stamp(uint16_t seq) const {
+  return static_cast<int64_t>((now() << 16) | seq);
+}
+
+void StreamTrace::onPoll(int64_t reservedValue) {
+  auto value = static_cast<uint64_t>(reservedValue);
+  if (value == 0) {
+    sentAt_ = 0;
+    return;
+  }
+
+  sentAt_ = value >> 16;
+  polledAt_ = now();
+
+  uint16_t seq = value & 0xffff;
+  KJ_IF_MAYBE(lastSeq, lastSeq_) {
+    if (seq != static_cast<uint16_t>(*lastSeq + 1)) {
+      ++gaps_;
+    }
+  }
+  lastSeq_ = seq;
+}
+
+void StreamTrace::onDelivery() {
+  if (sentAt_ == 0) {
+    return;
+  }
+
+  // the timestamps wrap every 78 hours or so
+  auto latency = (polledAt_ - sentAt_) & TIMESTAMP_MASK;
+  if (latency > TIMESTAMP_MASK / 2) {
+    ++skewed_;
+  }
+  else {
+    sendToPoll_.record(latency);
+  }
+  pollToDelivery_.record((now() - polledAt_) & TIMESTAMP_MASK);
+  sentAt_ = 0;
+}
+
+void StreamTrace::reset() {
+  sendToPoll_.reset();
+  pollToDelivery_.reset();
+  gaps_ = 0;
+  skewed_ = 0;
+}
+
+kj::String StreamTrace::toString() const {
+  return kj::str(
+    "send-to-poll: ", sendToPoll_.toString(), "\n"
+    "poll-to-delivery: ", pollToDelivery_.toString(), "\n"
+    "gaps=", gaps_, " skewed=", skewed_);
+}
+
+}
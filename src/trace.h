@@ -0,0 +1,66 @@
+#pragma once
+// Copyright (c) 2023 Vaci Koblizek.
+// Licensed under the Apache 2.0 license found in the LICENSE file or at:
+//     https://opensource.org/licenses/Apache-2.0
+
+// One-way latency tracing. A stream with tracing enabled stamps the
+// reserved value of every frame it writes with the time it was sent, in
+// the top 48 bits as nanoseconds of the realtime clock, and a sequence
+// number in the bottom 16 bits. A traced stream reading stamped frames
+// then records how long each message took:
+//  - from being sent to its first fragment being polled, i.e. serialisation
+//    into the term, the media driver and the receiver's idling, and
+//  - from that poll to the whole message being delivered to the reader.
+//
+// Between hosts, the send-to-poll latency is only as good as the clocks
+// are synchronised. Multiplexed sessions, see mux.h, can't be traced, as
+// they carry the ids of their logical streams in the reserved value.
+
+#include "histogram.h"
+
+#include <kj/refcount.h>
+
+namespace aeroncap {
+
+struct StreamTrace
+  : kj::Refcounted {
+
+  // Reserved value for the next frame written. A zero reserved value is
+  // never a stamp, so unstamped frames are ignored.
+  uint16_t nextSeq() { return seq_++; }
+  int64_t stamp(uint16_t seq) const;
+
+  // The first fragment of a message has been polled, with `reservedValue`.
+  void onPoll(int64_t reservedValue);
+
+  // The message whose first fragment was last polled has been delivered.
+  void onDelivery();
+
+  Histogram const& sendToPoll() const { return sendToPoll_; }
+  Histogram const& pollToDelivery() const { return pollToDelivery_; }
+
+  // Messages whose sequence number didn't follow that of the last one.
+  uint64_t gaps() const { return gaps_; }
+
+  // Messages stamped later than they were polled, as by a clock behind the
+  // sender's. These are counted rather than recorded.
+  uint64_t skewed() const { return skewed_; }
+
+  void reset();
+
+  kj::String toString() const;
+
+private:
+  uint16_t seq_{0};
+
+  uint64_t sentAt_{0};
+  uint64_t polledAt_{0};
+  kj::Maybe<uint16_t> lastSeq_;
+
+  Histogram sendToPoll_;
+  Histogram pollToDelivery_;
+  uint64_t gaps_{0};
+  uint64_t skewed_{0};
+};
+
+}
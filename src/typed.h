@@ -0,0 +1,175 @@
+#pragma once
+// Copyright (c) 2023 Vaci Koblizek.
+// Licensed under the Apache 2.0 license found in the LICENSE file or at:
+//     https://opensource.org/licenses/Apache-2.0
+
+// One-way streams of a single struct type, for high rate events that need
+// none of the call and return bookkeeping of an RpcSystem. Each message is
+// a bare `T` root, without the rpc.capnp envelope.
+//
+// Both ends are built on the streams returned by the usual handshake: the
+// publisher on one from `Connector::connect`, the subscriber on one from
+// `Listener::accept`.
+
+#include "serialize.h"
+
+#include <capnp/message.h>
+#include <capnp/serialize.h>
+
+namespace aeroncap {
+
+template <typename T>
+struct TypedPublisher {
+
+  explicit TypedPublisher(kj::Own<AeronMessageStreamBase> stream)
+    : stream_{kj::mv(stream)}
+    , scratch_{kj::heapArray<capnp::word>(scratchWords(stream_->getPublication()))} {
+    memset(scratch_.begin(), 0, scratch_.asBytes().size());
+  }
+
+  // Calls `build` with a fresh `T::Builder`, then publishes the message.
+  // The message is built in a first segment sized to a single frame and
+  // reused from one message to the next, so that a message that fits is
+  // published without allocating, and is copied just once, into a claim.
+  // Resolves once the message has been published; only back pressure or a
+  // message too big for one frame makes it wait, and messages published
+  // meanwhile queue behind it, in order.
+  template <typename Func>
+  kj::Promise<void> publish(Func&& build) {
+    capnp::MallocMessageBuilder mb{scratch_};
+    build(mb.initRoot<T>());
+    return send(mb);
+  }
+
+  kj::Promise<void> publish(typename T::Reader value) {
+    capnp::MallocMessageBuilder mb{scratch_};
+    mb.setRoot(value);
+    return send(mb);
+  }
+
+  AeronMessageStreamBase& getStream() { return *stream_; }
+
+private:
+  kj::Promise<void> send(capnp::MallocMessageBuilder& mb) {
+    auto& pub = stream_->getPublication();
+    auto segments = mb.getSegmentsForOutput();
+    auto byteSize = capnp::computeSerializedSizeInWords(segments) * sizeof(capnp::word);
+    if (KJ_LIKELY(pending_ == 0 && byteSize <= pub.maxPayloadLength()) &&
+	_::tryClaim(pub, segments, byteSize)) {
+      return kj::READY_NOW;
+    }
+
+    // the scratch segment is reused by the next message, so take a copy
+    auto copy = kj::heap<capnp::MallocMessageBuilder>();
+    copy->setRoot(mb.getRoot<T>().asReader());
+
+    // behind any write still pending, lest this one overtake it
+    ++pending_;
+    auto promise = tail_.addBranch().then(
+      [this, copy = kj::mv(copy)]() mutable {
+	auto segments = copy->getSegmentsForOutput();
+	return _::writeMessage(stream_->getWriteIdler(), stream_->getPublication(), segments)
+	  .attach(kj::mv(copy));
+      }).then(
+	[this]() { --pending_; },
+	[this](kj::Exception&& exc) {
+	  --pending_;
+	  kj::throwFatalException(kj::mv(exc));
+	});
+    tail_ = promise.fork();
+    return tail_.addBranch();
+  }
+
+  static size_t scratchWords(::aeron::ExclusivePublication& pub) {
+    // less the segment table of a single segment message
+    return pub.maxPayloadLength() / sizeof(capnp::word) - 1;
+  }
+
+  kj::Own<AeronMessageStreamBase> stream_;
+  kj::Array<capnp::word> scratch_;
+  // writes that couldn't be claimed at once, and the last of them
+  uint32_t pending_{0};
+  kj::ForkedPromise<void> tail_{kj::Promise<void>(kj::READY_NOW).fork()};
+};
+
+template <typename T>
+struct TypedSubscriber {
+
+  // Blob handles are followed only if the stream already accepts them.
+  explicit TypedSubscriber(kj::Own<AeronMessageStreamBase> stream)
+    : stream_{kj::mv(stream)}
+    , assembler_{stream_->getReaderOptions(), nullptr, nullptr, stream_->getBlobMapper()} {
+  }
+
+  // Calls `handler` with the `T::Reader` of each message available, and
+  // returns the number of messages and fragments read. A single segment
+  // message that arrived in a single frame is read in place, so its reader
+  // is only valid for the duration of the call. Anything else, e.g. a
+  // message that arrived during the handshake, goes the way of
+  // `readMessage`.
+  template <typename Handler>
+  int poll(Handler&& handler, int fragmentLimit = 16) {
+    namespace frame = ::aeron::FrameDescriptor;
+    using Action = ::aeron::ControlledPollAction;
+
+    int early = 0;
+    while (true) {
+      KJ_IF_MAYBE(reader, stream_->popEarlyMessage()) {
+	handler((*reader)->template getRoot<T>());
+	++early;
+	continue;
+      }
+      break;
+    }
+
+    return early + stream_->getImage().controlledPoll(
+      [this, &handler](auto& buffer, auto offset, auto length, auto& header) {
+	auto bytes = buffer.buffer() + offset;
+	if (KJ_LIKELY((header.flags() & frame::UNFRAGMENTED) == frame::UNFRAGMENTED)) {
+	  KJ_IF_MAYBE(segmentSize, _::singleSegmentSize(bytes, length)) {
+	    kj::ArrayPtr<capnp::word const> segments[] = {
+	      kj::arrayPtr(reinterpret_cast<capnp::word const*>(bytes) + 1, *segmentSize)
+	    };
+	    capnp::SegmentArrayMessageReader reader{segments, stream_->getReaderOptions()};
+	    handler(reader.getRoot<T>());
+	    return Action::CONTINUE;
+	  }
+	}
+
+	auto action = assembler_.onFragment(bytes, length, header.flags());
+	KJ_IF_MAYBE(reader, assembler_.release()) {
+	  handler((*reader)->template getRoot<T>());
+	  return Action::CONTINUE;
+	}
+	return action;
+      },
+      fragmentLimit
+    );
+  }
+
+  // Polls until the end of the stream, idling with the stream's read idler
+  // whenever there is nothing to read.
+  template <typename Handler>
+  kj::Promise<void> run(Handler handler, int fragmentLimit = 16) {
+    auto& idler = stream_->getReadIdler();
+    auto& image = stream_->getImage();
+
+    while (true) {
+      if (poll(handler, fragmentLimit)) {
+	idler.reset();
+      }
+      else if (KJ_UNLIKELY(image.isEndOfStream() || image.isClosed())) {
+	co_return;
+      }
+      co_await idler.idle();
+    }
+  }
+
+  AeronMessageStreamBase& getStream() { return *stream_; }
+
+private:
+  kj::Own<AeronMessageStreamBase> stream_;
+  _::MessageAssembler assembler_;
+};
+
+}